@@ -1,4 +1,7 @@
+#include "op_profiler.h"
+#include "rewrite_advisor.h"
 #include "xml_operations.h"
+#include "xpath_cache.h"
 
 #include "absl/strings/str_cat.h"
 #include "pugixml.hpp"
@@ -19,6 +22,23 @@ int main(int argc, const char **argv)
 
     spdlog::set_level(spdlog::level::debug);
 
+    // --profile trace.json writes the time every op took
+    // --advise lists the ops that could use an index, --rewrite patch.xml also writes them so
+    fs::path trace_path;
+    fs::path rewrite_path;
+    bool     advise = false;
+    for (int i = 3; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--rewrite") == 0 && i + 1 < argc) {
+            rewrite_path = argv[++i];
+            advise       = true;
+        } else if (std::strcmp(argv[i], "--advise") == 0) {
+            advise = true;
+        }
+    }
+    OpProfiler::instance().Enable(!trace_path.empty());
+
     std::ifstream   file(argv[1], std::ios::binary | std::ios::ate);
     std::streamsize size = file.tellg();
     file.seekg(0, std::ios::beg);
@@ -31,9 +51,21 @@ int main(int argc, const char **argv)
     }
 
     auto operations = XmlOperation::GetXmlOperationsFromFile(argv[2]);
-    for (auto &&operation : operations) {
-        operation.Apply(doc);
+    if (advise) {
+        const auto advice = RewriteAdvisor::Analyse(operations, doc);
+        RewriteAdvisor::Log(operations, advice);
+        if (!rewrite_path.empty()) {
+            RewriteAdvisor::WriteRewritten(operations, advice, argv[2], rewrite_path);
+        }
+    }
+    XmlOperation::ApplyOperations(operations, doc);
+    if (!trace_path.empty()) {
+        OpProfiler::instance().Enable(false);
+        OpProfiler::instance().LogSummary(20);
+        OpProfiler::instance().WriteTrace(trace_path);
     }
+    spdlog::debug("XPath cache: {} hits, {} misses", XPathCache::instance().Hits(),
+                  XPathCache::instance().Misses());
 
     struct xml_string_writer : pugi::xml_writer {
         std::string result;
@@ -1,7 +1,9 @@
 #pragma once
 
 #include "mod.h"
+#include "xml_operations.h"
 
+#include "ksignals/ksignals.h"
 #include "nlohmann/json.hpp"
 
 #include <Windows.h>
@@ -34,7 +36,9 @@ class ModManager
 
     ~ModManager();
 
-    void Shutdown();
+    // The log is only written out if not in_dll_main, joining the logging thread under the
+    // loader lock could dead lock
+    void Shutdown(bool in_dll_main = false);
 
     static fs::path GetModsDirectory();
     static fs::path GetCacheDirectory();
@@ -52,6 +56,10 @@ class ModManager
 
     static fs::path MapAliasedPath(fs::path path);
 
+    // Fired on the loading thread once all patches are applied, also after reloads. The log is
+    // flushed right after.
+    ksignals::Event<void()> ModsLoaded;
+
   private:
     bool IsPatchableFile(const fs::path& file) const;
     bool IsPythonStartScript(const fs::path& file) const;
@@ -74,6 +82,21 @@ class ModManager
                                const std::string& mod_name = "");
     void        WriteCacheInfo(const fs::path& game_path);
 
+    // Ops of a patch file are kept as an OpBundle next to the cache layers, so unchanged patches
+    // are not parsed again when a layer before them has to be redone
+    fs::path                  GetOpBundlePath(const fs::path&    on_disk_file,
+                                              const std::string& patch_file_hash) const;
+    // Hash of the patch together with the files its bundle lists as dependencies, what the cache
+    // layer of the patch is keyed by. A change to an include or table file misses the cache.
+    std::string               GetPatchHash(const std::string& patch_file_hash,
+                                           const fs::path&    bundle_path) const;
+    // Same as GetFileHash, a placeholder for files that can't be read
+    std::string               GetDependencyHash(const fs::path& file) const;
+    std::vector<XmlOperation> ReadOperations(const fs::path& game_path,
+                                             const fs::path& on_disk_file,
+                                             const fs::path& bundle_path,
+                                             const std::string& mod_name) const;
+
     struct CacheLayer {
         std::string input_hash;
         std::string patch_hash;
@@ -3,9 +3,15 @@
 #include "meow_hash_x64_aesni.h"
 
 #include "anno/random_game_functions.h"
+#include "op_bundle.h"
+#include "op_profiler.h"
+#include "rewrite_advisor.h"
+#include "worker_pool.h"
 #include "xml_operations.h"
+#include "xpath_cache.h"
 
 #include "absl/strings/str_cat.h"
+#include "spdlog/async.h"
 #include "spdlog/spdlog.h"
 
 #define ZSTD_STATIC_LINKING_ONLY /* ZSTD_compressContinue, ZSTD_compressBlock */
@@ -21,11 +27,29 @@
 
 #include <Windows.h>
 
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <optional>
 #include <sstream>
+#include <string_view>
+#include <unordered_set>
 
-constexpr static auto PATCH_OP_VERSION = "1.17";
+constexpr static auto PATCH_OP_VERSION = "1.18";
+
+// Writes what was logged so far. The default logger may hand its messages to a logging thread,
+// its queue is waited for, but not forever. Must not be called from DllMain, the logging thread
+// can't make progress there.
+static void DrainLog()
+{
+    spdlog::default_logger()->flush();
+    if (auto pool = spdlog::thread_pool()) {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        while (pool->queue_size() > 0 && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+}
 
 Mod& ModManager::Create(const fs::path& root)
 {
@@ -34,6 +58,64 @@ Mod& ModManager::Create(const fs::path& root)
     return mod;
 }
 
+// Read only view of a whole file
+class MappedFile
+{
+  public:
+    explicit MappedFile(const fs::path& path)
+    {
+        file_ = CreateFileW(path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file_ == INVALID_HANDLE_VALUE) {
+            return;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0) {
+            return;
+        }
+        mapping_ = CreateFileMappingW(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping_) {
+            return;
+        }
+        view_ = MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+        if (view_) {
+            size_ = static_cast<size_t>(size.QuadPart);
+        }
+    }
+
+    ~MappedFile()
+    {
+        if (view_) {
+            UnmapViewOfFile(view_);
+        }
+        if (mapping_) {
+            CloseHandle(mapping_);
+        }
+        if (file_ != INVALID_HANDLE_VALUE) {
+            CloseHandle(file_);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    explicit operator bool() const
+    {
+        return view_ != nullptr;
+    }
+
+    std::string_view Data() const
+    {
+        return {static_cast<const char*>(view_), size_};
+    }
+
+  private:
+    HANDLE file_    = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+    void*  view_    = nullptr;
+    size_t size_    = 0;
+};
+
 static bool IsModEnabled(fs::path path)
 {
     // If mod folder name starts with '-', we don't enable it.
@@ -373,6 +455,79 @@ std::string ModManager::PushCacheLayer(const fs::path&    game_path,
     return layer.output_hash;
 }
 
+fs::path ModManager::GetOpBundlePath(const fs::path&    on_disk_file,
+                                     const std::string& patch_file_hash) const
+{
+    // The same patch can include different files in different mods
+    return GetCacheDirectory() / "ops"
+           / GetDataHash(absl::StrCat(patch_file_hash, on_disk_file.generic_string()));
+}
+
+std::string ModManager::GetPatchHash(const std::string& patch_file_hash,
+                                     const fs::path&    bundle_path) const
+{
+    MappedFile bundle(bundle_path);
+    if (!bundle) {
+        return patch_file_hash;
+    }
+    const auto dependencies = OpBundle::ReadDependencies(bundle.Data());
+    if (!dependencies || dependencies->empty()) {
+        return patch_file_hash;
+    }
+    // Hashes of the files as they are now, a changed, missing or created one gives another hash
+    auto data = patch_file_hash;
+    for (const auto& dependency : *dependencies) {
+        absl::StrAppend(&data, GetDependencyHash(dependency.first));
+    }
+    return GetDataHash(data);
+}
+
+std::string ModManager::GetDependencyHash(const fs::path& file) const
+{
+    // Runs on the worker pool, a missing include must not take it down
+    try {
+        return GetFileHash(file);
+    } catch (...) {
+        return "missing";
+    }
+}
+
+std::vector<XmlOperation> ModManager::ReadOperations(const fs::path&    game_path,
+                                                     const fs::path&    on_disk_file,
+                                                     const fs::path&    bundle_path,
+                                                     const std::string& mod_name) const
+{
+    if (MappedFile bundle(bundle_path); bundle) {
+        const auto dependencies = OpBundle::ReadDependencies(bundle.Data());
+        if (dependencies
+            && std::all_of(begin(*dependencies), end(*dependencies), [&](const auto& dependency) {
+                   return GetDependencyHash(dependency.first) == dependency.second;
+               })) {
+            if (auto operations =
+                    OpBundle::Read(bundle.Data(), mod_name, game_path, on_disk_file)) {
+                return std::move(*operations);
+            }
+        }
+    }
+
+    std::vector<fs::path> includes;
+    auto operations = XmlOperation::GetXmlOperationsFromFile(on_disk_file, mod_name, game_path,
+                                                             on_disk_file, &includes);
+    // Nothing to gain from a bundle of a broken patch, and the errors should show up again.
+    // Broken includes are kept as dependencies, the cache layer of the patch is keyed by them.
+    if (operations.empty() && includes.empty()) {
+        return operations;
+    }
+    OpBundle::Dependencies dependencies;
+    for (const auto& include : includes) {
+        dependencies.emplace_back(include.string(), GetDependencyHash(include));
+    }
+    const auto    data = OpBundle::Write(operations, dependencies);
+    std::ofstream ofs(bundle_path, std::ofstream::binary);
+    ofs.write(data.data(), data.size());
+    return operations;
+}
+
 void ModManager::EnsureDummy()
 {
     static auto dummy_path = ModManager::GetDummyPath();
@@ -401,10 +556,17 @@ void ModManager::GameFilesReady()
         spdlog::info("Start applying xml operations");
 
         const auto cache_directory = ModManager::GetCacheDirectory();
+        // A .profile file in the mods directory turns on timing every op that gets applied and
+        // lists the ops that could find their targets through an index
+        const bool profile = fs::exists(ModManager::GetModsDirectory() / ".profile");
+        OpProfiler::instance().Enable(profile);
 
         CollectPatchableFiles();
         ReadCache();
 
+        fs::create_directories(cache_directory / "ops");
+        std::unordered_set<std::string> used_bundles;
+
         for (auto&& modded_file : modded_patchable_files_) {
             if (shuttding_down_.load()) {
                 return;
@@ -412,6 +574,52 @@ void ModManager::GameFilesReady()
 
             auto&& [game_path, on_disk_files] = modded_file;
 
+            // Patches are parsed on the worker pool while the game file is read, starting with
+            // the first one no cache layer was made from. Any before that are parsed when they
+            // turn out to miss the cache after all.
+            std::vector<std::string> file_hashes;
+            for (auto& on_disk_file : on_disk_files) {
+                file_hashes.push_back(GetFileHash(on_disk_file));
+            }
+            // What the cache layers are keyed by, see GetPatchHash
+            std::vector<std::string> patch_file_hashes(on_disk_files.size());
+            std::vector<std::shared_ptr<PendingTask<std::vector<XmlOperation>>>> parsed_operations(
+                on_disk_files.size());
+            std::vector<fs::path> bundle_paths;
+            for (size_t i = 0; i < on_disk_files.size(); ++i) {
+                bundle_paths.push_back(GetOpBundlePath(on_disk_files[i], file_hashes[i]));
+                used_bundles.insert(bundle_paths.back().filename().string());
+                patch_file_hashes[i] = GetPatchHash(file_hashes[i], bundle_paths[i]);
+            }
+            const auto parse_from = [this, &modded_file, &parsed_operations, &patch_file_hashes,
+                                     &bundle_paths](size_t first) {
+                for (size_t i = first; i < parsed_operations.size(); ++i) {
+                    if (!parsed_operations[i]) {
+                        auto& on_disk_file   = modded_file.second[i];
+                        auto& mod            = GetModContainingFile(on_disk_file);
+                        parsed_operations[i] =
+                            WorkerPool::instance().Start<std::vector<XmlOperation>>(
+                                [this, game_path = modded_file.first, on_disk_file,
+                                 bundle_path = bundle_paths[i], mod_name = mod.Name()]() {
+                                    return ReadOperations(game_path, on_disk_file, bundle_path,
+                                                          mod_name);
+                                });
+                    }
+                }
+            };
+            {
+                const auto& layers = modded_file_cache_info_[game_path];
+                size_t      first  = 0;
+                while (first < on_disk_files.size()
+                       && std::any_of(begin(layers), end(layers),
+                                      [&patch_hash = patch_file_hashes[first]](const auto& layer) {
+                                          return layer.patch_hash == patch_hash;
+                                      })) {
+                    first++;
+                }
+                parse_from(first);
+            }
+
             auto game_file = ReadGameFile(game_path);
             if (game_file.empty()) {
                 for (auto& on_disk_file : on_disk_files) {
@@ -425,11 +633,12 @@ void ModManager::GameFilesReady()
             std::string                         last_valid_cache = "";
             std::string                         next_input_hash  = game_file_hash;
 
-            for (auto&& on_disk_file : on_disk_files) {
+            for (size_t i = 0; i < on_disk_files.size(); ++i) {
                 if (shuttding_down_.load()) {
                     return;
                 }
-                auto       patch_file_hash = GetFileHash(on_disk_file);
+                const auto& on_disk_file    = on_disk_files[i];
+                auto&       patch_file_hash = patch_file_hashes[i];
                 const auto output_hash =
                     CheckCacheLayer(game_path, next_input_hash, patch_file_hash);
                 if (output_hash) {
@@ -455,13 +664,23 @@ void ModManager::GameFilesReady()
                         }
                     }
 
-                    // Cache miss
-                    auto &mod = GetModContainingFile(on_disk_file);
-                    auto operations = XmlOperation::GetXmlOperationsFromFile(
-                        on_disk_file, mod.Name(), game_path, on_disk_file);
-                    for (auto&& operation : operations) {
-                        operation.Apply(game_xml);
+                    // Cache miss, every patch after this one misses as well
+                    parse_from(i);
+                    std::vector<XmlOperation> operations;
+                    try {
+                        operations = parsed_operations[i]->Get();
+                    } catch (const std::exception& e) {
+                        spdlog::error("Failed to read {}: {}", on_disk_file.string(), e.what());
                     }
+                    parsed_operations[i] = nullptr;
+                    // The bundle was (re)written while reading, its dependencies might have
+                    // changed. The layer is keyed the way the next run will look it up.
+                    patch_file_hash = GetPatchHash(file_hashes[i], bundle_paths[i]);
+                    if (profile) {
+                        RewriteAdvisor::Log(operations,
+                                            RewriteAdvisor::Analyse(operations, game_xml));
+                    }
+                    XmlOperation::ApplyOperations(operations, game_xml);
 
                     struct xml_string_writer : pugi::xml_writer {
                         std::string result;
@@ -495,6 +714,26 @@ void ModManager::GameFilesReady()
             game_xml = nullptr;
         }
 
+        // The included documents are only shared between the patches of one load
+        XmlOperation::ClearIncludeCache();
+
+        // Bundles of patch files that changed or are gone
+        for (auto& file : fs::directory_iterator(cache_directory / "ops")) {
+            if (used_bundles.count(file.path().filename().string()) == 0) {
+                std::error_code ec;
+                fs::remove(file, ec);
+            }
+        }
+
+        spdlog::debug("XPath cache: {} hits, {} misses", XPathCache::instance().Hits(),
+                      XPathCache::instance().Misses());
+        if (profile) {
+            OpProfiler::instance().Enable(false);
+            OpProfiler::instance().LogSummary(20);
+            OpProfiler::instance().WriteTrace(ModManager::GetModsDirectory().parent_path() / "logs"
+                                              / "mod-loader-trace.json");
+        }
+
         StartWatchingFiles();
 
         {
@@ -502,6 +741,8 @@ void ModManager::GameFilesReady()
             mods_ready_.store(true);
         }
         spdlog::info("Finished applying xml operations");
+        ModsLoaded();
+        DrainLog();
 
         mods_ready_cv_.notify_all();
 
@@ -537,10 +778,11 @@ const ModManager::File& ModManager::GetModdedFileInfo(const fs::path& path) cons
 
 ModManager::~ModManager()
 {
-    Shutdown();
+    // Static destructors of a DLL run while it is unloaded
+    Shutdown(true);
 }
 
-void ModManager::Shutdown()
+void ModManager::Shutdown(bool in_dll_main)
 {
     shuttding_down_.store(true);
     //
@@ -558,6 +800,9 @@ void ModManager::Shutdown()
         thread.join();
         thread = {};
     }
+    if (!in_dll_main) {
+        DrainLog();
+    }
 }
 
 fs::path ModManager::GetModsDirectory()
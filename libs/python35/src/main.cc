@@ -1,5 +1,6 @@
 #include "interface.h"
 
+#include "rate_limited_sink.h"
 #include "version.h"
 
 #if defined(INTERNAL_ENABLED)
@@ -9,6 +10,7 @@
 #include "libs/external-file-loader/include/mod_manager.h"
 
 #include "nlohmann/json.hpp"
+#include "spdlog/async.h"
 #include "spdlog/sinks/basic_file_sink.h"
 #include "spdlog/sinks/stdout_color_sinks.h"
 #include "spdlog/spdlog.h"
@@ -19,6 +21,7 @@
 
 #pragma comment(lib, "Wininet.lib")
 
+#include <chrono>
 #include <cstdio>
 #include <filesystem>
 #include <thread>
@@ -357,21 +360,31 @@ BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserv
 
                         fs::create_directories(logs_directory);
 
-                        // Set the default logger to file logger
-                        auto file_logger = spdlog::basic_logger_mt(
-                            "default", (logs_directory / "mod-loader.log").wstring());
+                        // Set the default logger to file logger. Messages are written by a
+                        // background thread so the file hooks don't wait for the disk, and the
+                        // same warning is only written 20 times.
+                        spdlog::init_thread_pool(8192, 1);
+                        auto sink = std::make_shared<RateLimitedSink>(20);
+                        sink->add_sink(std::make_shared<spdlog::sinks::basic_file_sink_mt>(
+                            (logs_directory / "mod-loader.log").wstring()));
+                        sink->add_sink(std::make_shared<spdlog::sinks::stdout_color_sink_mt>());
+                        auto file_logger = std::make_shared<spdlog::async_logger>(
+                            "default", sink, spdlog::thread_pool(),
+                            spdlog::async_overflow_policy::block);
                         spdlog::set_default_logger(file_logger);
-
-                        file_logger->sinks().push_back(
-                            std::make_shared<spdlog::sinks::stdout_color_sink_mt>());
+                        // Whatever was left out while loading is logged by the flush the loader
+                        // does once it is done
+                        ModManager::instance().ModsLoaded.connect(
+                            [sink]() { sink->SummarizeOnFlush(); });
 
                         #if defined(INTERNAL_ENABLED)
                             spdlog::set_level(spdlog::level::debug);
                             spdlog::flush_on(spdlog::level::debug);
                         #else
                             spdlog::set_level(spdlog::level::info);
-                            spdlog::flush_on(spdlog::level::info);
+                            spdlog::flush_on(spdlog::level::err);
                         #endif
+                        spdlog::flush_every(std::chrono::seconds(1));
                         spdlog::set_pattern("[%Y-%m-%d %T.%e] [%^%l%$] %v");
                     } catch (const fs::filesystem_error& e) {
                         // TODO(alexander): Logs
@@ -396,7 +409,9 @@ BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserv
             break;
         case DLL_PROCESS_DETACH: {
             FreeConsole();
-            ModManager::instance().Shutdown();
+            // Nothing here may wait for the logging thread, it is either gone or can't run
+            // until we return. The log was written out when loading finished.
+            ModManager::instance().Shutdown(true);
         } break;
     }
     return TRUE;
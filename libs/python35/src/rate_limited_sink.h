@@ -0,0 +1,121 @@
+#pragma once
+
+#include "spdlog/details/log_msg.h"
+#include "spdlog/sinks/dist_sink.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Forwards to its sinks, but warnings and errors only up to limit times per template, i.e. the
+// message with paths, numbers and quoted values left out. A mod with thousands of broken ops
+// would otherwise write the same line thousands of times. How many were dropped is logged once
+// they stop coming, on the first flush after a flush interval without another one, or on the
+// flush after SummarizeOnFlush.
+class RateLimitedSink : public spdlog::sinks::dist_sink_mt
+{
+  public:
+    explicit RateLimitedSink(size_t limit)
+        : limit_(limit)
+    {
+    }
+
+    // The next flush logs how many of each message were dropped, even if they are still coming
+    void SummarizeOnFlush()
+    {
+        summarize_ = true;
+    }
+
+  protected:
+    using Base = spdlog::sinks::dist_sink_mt;
+
+    void sink_it_(const spdlog::details::log_msg& msg) override
+    {
+        if (msg.level < spdlog::level::warn) {
+            Base::sink_it_(msg);
+            return;
+        }
+        auto& counter = counters_[Template(msg)];
+        if (counter.logged < limit_) {
+            counter.logged++;
+            Base::sink_it_(msg);
+            return;
+        }
+        counter.level = msg.level;
+        counter.dropped++;
+        counter.recent = true;
+    }
+
+    void flush_() override
+    {
+        const bool all = summarize_.exchange(false);
+        for (auto& [key, counter] : counters_) {
+            if (counter.recent && !all) {
+                counter.recent = false;
+            } else if (counter.dropped > 0) {
+                const auto summary = "Left out " + std::to_string(counter.dropped)
+                                     + " more messages like: " + key;
+                Base::sink_it_(
+                    spdlog::details::log_msg("", counter.level, {summary.data(), summary.size()}));
+                counter.dropped = 0;
+                counter.recent  = false;
+            }
+        }
+        Base::flush_();
+    }
+
+  private:
+    struct Counter {
+        size_t                    logged  = 0;
+        size_t                    dropped = 0; // Since the last summary
+        bool                      recent  = false;
+        spdlog::level::level_enum level   = spdlog::level::warn;
+    };
+
+    // Words with digits, paths, brackets or quotes in them become *, except for the [mod] the
+    // message starts with
+    static std::string Template(const spdlog::details::log_msg& msg)
+    {
+        const std::string_view payload{msg.payload.data(), msg.payload.size()};
+
+        std::string result;
+        size_t      i = 0;
+        if (const auto end = payload.find(']'); !payload.empty() && payload[0] == '['
+                                                 && end != std::string_view::npos) {
+            i = end + 1;
+            result.assign(payload.substr(0, i));
+        }
+
+        std::string word;
+        const auto  add_word = [&result, &word]() {
+            if (word.empty()) {
+                return;
+            }
+            const bool variable = std::any_of(word.begin(), word.end(), [](char c) {
+                return isdigit(static_cast<unsigned char>(c)) || strchr("/\\[]'\"=:", c);
+            });
+            if (!result.empty()) {
+                result += ' ';
+            }
+            result += variable ? "*" : word;
+            word.clear();
+        };
+        for (; i < payload.size(); ++i) {
+            if (payload[i] == ' ') {
+                add_word();
+            } else {
+                word += payload[i];
+            }
+        }
+        add_word();
+        return result;
+    }
+
+    const size_t                             limit_;
+    std::unordered_map<std::string, Counter> counters_;
+    std::atomic_bool                         summarize_ = false;
+};
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "pugixml.hpp"
+
+#include <cstddef>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Finds the game nodes a merge writes to. Levels are scanned until more than THRESHOLD siblings
+// were looked at, after that their children are looked up by name instead.
+// Merging only changes attributes and text, so a level stays valid for the whole merge.
+class MergeIndex
+{
+  public:
+    constexpr static size_t THRESHOLD = 16;
+
+    // First of node and its following siblings called name
+    pugi::xml_node FindFrom(pugi::xml_node node, const char* name);
+
+  private:
+    struct Level {
+        std::vector<pugi::xml_node>                                children;
+        std::unordered_map<pugi::xml_node_struct*, size_t>         positions;
+        std::unordered_map<std::string_view, std::vector<size_t>> by_name; // Ascending
+    };
+
+    Level&         Build(pugi::xml_node parent);
+    pugi::xml_node FindFrom(const Level& level, pugi::xml_node node, const char* name) const;
+
+    std::unordered_map<pugi::xml_node_struct*, Level> levels_;
+};
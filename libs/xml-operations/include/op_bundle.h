@@ -0,0 +1,29 @@
+#pragma once
+
+#include "xml_operations.h"
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Compact binary form of the ops read from a patch file, includes already expanded. Holds the
+// ModOp elements with their content, so reading it back skips parsing XML and loading includes.
+// The ops are analysed again when read, a bundle stays valid when that analysis changes.
+class OpBundle
+{
+  public:
+    // Files the ops were read from besides the patch itself, with a hash of their content
+    using Dependencies = std::vector<std::pair<std::string, std::string>>;
+
+    static std::string Write(const std::vector<XmlOperation>& operations,
+                             const Dependencies&              dependencies);
+
+    // No value if data isn't a bundle of this version or is cut short
+    static std::optional<Dependencies>              ReadDependencies(std::string_view data);
+    static std::optional<std::vector<XmlOperation>> Read(std::string_view data,
+                                                         std::string      mod_name  = "",
+                                                         fs::path         game_path = {},
+                                                         fs::path         mod_path  = {});
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Records how long every op applied while enabled took to look up and apply, to tell mod authors
+// which of their ops make loading slow. Costs a single check per op when disabled.
+class OpProfiler
+{
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Sample {
+        std::string mod_name;
+        fs::path    patch_path;
+        ptrdiff_t   offset = -1; // Of the op in patch_path, turned into a line when reported
+        std::string path;
+        std::string type;
+
+        // How the targets were found, e.g. "guid index" or "full path"
+        std::string lookup;
+        bool        prefetched = false; // Looked up on the worker pool ahead of time
+
+        Clock::time_point start;
+        Clock::duration   lookup_time{};
+        Clock::duration   apply_time{};
+        size_t            matches = 0;
+        size_t            copied  = 0; // Content nodes added to the game file
+    };
+
+    static OpProfiler& instance()
+    {
+        static OpProfiler instance;
+        return instance;
+    }
+
+    // Enabling drops the samples recorded so far
+    void Enable(bool enabled);
+    bool Enabled() const
+    {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    void Add(Sample sample);
+
+    // Logs the count slowest ops and the time spent per lookup strategy
+    void LogSummary(size_t count) const;
+    // Chrome trace event file, open it in chrome://tracing or https://ui.perfetto.dev
+    bool WriteTrace(const fs::path& path) const;
+
+  private:
+    OpProfiler() = default;
+
+    std::atomic<bool>   enabled_ = false;
+    mutable std::mutex  mutex_;
+    Clock::time_point   origin_;
+    std::vector<Sample> samples_;
+};
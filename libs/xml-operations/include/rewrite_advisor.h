@@ -0,0 +1,48 @@
+#pragma once
+
+#include "xml_operations.h"
+
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Tells mod authors how each of their ops finds its targets, and for ops that search the whole
+// file whether the same targets can be found through the GUID index instead, e.g.
+// //Asset[Values/Standard/GUID='1' or Values/Standard/GUID='2']/Values becomes
+// GUID='1,2' Path='/Values'.
+class RewriteAdvisor
+{
+  public:
+    struct Advice {
+        size_t      operation; // Index into the ops given to Analyse
+        std::string lookup;    // How the op finds its targets, e.g. "guid index" or "full path"
+
+        // GUID and Path of the indexed form, only for ops without an index lookup
+        std::optional<std::pair<std::string, std::string>> rewrite;
+
+        // Rough number of nodes a lookup visits as the op is written and rewritten, for one
+        // lookup on the document given to Analyse
+        size_t scanned           = 0;
+        size_t scanned_rewritten = 0;
+    };
+
+    // doc is the game file the ops will be applied to, it is only used for the estimates
+    static std::vector<Advice> Analyse(const std::vector<XmlOperation>&    operations,
+                                       std::shared_ptr<pugi::xml_document> doc);
+
+    // Lists the ops that have a rewrite and how many ops use each kind of lookup
+    static void Log(const std::vector<XmlOperation>& operations,
+                    const std::vector<Advice>&       advice);
+
+    // Copy of the patch file at patch_path with the ops read from it rewritten. Ops that came
+    // from includes are left alone.
+    static bool WriteRewritten(const std::vector<XmlOperation>& operations,
+                               const std::vector<Advice>& advice, const fs::path& patch_path,
+                               const fs::path& path);
+
+  private:
+    static std::optional<std::pair<std::string, std::string>>
+    ProposeRewrite(const XmlOperation& operation);
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Task handed to the pool that somebody waits for. Whoever gets to it first runs it, so the
+// waiting thread never blocks on a task that is still queued. What the task throws is thrown
+// from Get, it must not escape a pool thread.
+template <typename T> struct PendingTask {
+    std::function<T()> task;
+
+    std::mutex              mutex;
+    std::condition_variable done;
+    bool                    started  = false;
+    bool                    finished = false;
+    T                       result{};
+    std::exception_ptr      error;
+
+    void Run()
+    {
+        {
+            std::scoped_lock lk{mutex};
+            if (started) {
+                return;
+            }
+            started = true;
+        }
+        T                  value{};
+        std::exception_ptr exception;
+        try {
+            value = task();
+        } catch (...) {
+            exception = std::current_exception();
+        }
+        {
+            std::scoped_lock lk{mutex};
+            result   = std::move(value);
+            error    = std::move(exception);
+            finished = true;
+        }
+        done.notify_all();
+    }
+
+    // Can only be called once
+    T Get()
+    {
+        Run();
+        std::unique_lock lk{mutex};
+        done.wait(lk, [this]() { return finished; });
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return std::move(result);
+    }
+};
+
+// Process wide set of threads for work that can run next to the patching thread, e.g. looking up
+// the targets of upcoming ops while the current one is applied. Has no threads on single core
+// machines.
+class WorkerPool
+{
+  public:
+    static WorkerPool& instance();
+
+    size_t Size() const;
+
+    // Runs task on one of the threads at some point, the caller has to track completion
+    void Submit(std::function<void()> task);
+
+    // Submits task, its result is waited for with Get()
+    template <typename T> std::shared_ptr<PendingTask<T>> Start(std::function<T()> task)
+    {
+        auto pending  = std::make_shared<PendingTask<T>>();
+        pending->task = std::move(task);
+        if (Size() > 0) {
+            Submit([pending]() { pending->Run(); });
+        }
+        return pending;
+    }
+
+  private:
+    explicit WorkerPool(size_t threads);
+
+    void Run();
+
+    std::mutex                        mutex_;
+    std::condition_variable           wake_;
+    std::deque<std::function<void()>> tasks_;
+    std::vector<std::thread>          threads_;
+};
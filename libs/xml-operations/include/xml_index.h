@@ -0,0 +1,182 @@
+#pragma once
+
+#include "pugixml.hpp"
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Maps the text of a fixed child path (e.g. Values/Standard/GUID) to every element with a
+// given name that carries it. Nodes sharing a key are kept in document order.
+class XmlNodeIndex
+{
+  public:
+    XmlNodeIndex(std::string element, std::vector<std::string> key_path, bool ignore_case);
+
+    bool IsBuilt() const;
+    void Build(pugi::xml_node root);
+
+    bool        IsIndexed(pugi::xml_node node) const;
+    std::string Key(pugi::xml_node node) const;
+
+    const std::vector<pugi::xml_node>* Find(const std::string& key) const;
+
+    void Add(const std::string& key, pugi::xml_node node);
+    void Remove(const std::string& key, pugi::xml_node node);
+
+    // Add/Remove every indexed element in the subtree of root
+    void Insert(pugi::xml_node root);
+    void Erase(pugi::xml_node root);
+
+    // Changes whenever a node is added, removed or re-keyed
+    size_t Version() const;
+
+  private:
+    std::string              element_;
+    std::vector<std::string> key_path_;
+    bool                     ignore_case_ = false;
+    bool                     built_       = false;
+    size_t                   version_     = 0;
+
+    std::unordered_map<std::string, std::vector<pugi::xml_node>> nodes_;
+};
+
+// An index over the elements called element by the text at key_path, e.g. Asset by Template
+struct XmlIndexDefinition {
+    std::string              element;
+    std::vector<std::string> key_path;
+};
+
+// Every element of a document by name, e.g. to start //Name steps from.
+// Nodes added later are appended and the list is sorted again when it is asked for.
+class XmlNameIndex
+{
+  public:
+    bool IsBuilt() const;
+    void Build(pugi::xml_node root);
+
+    // Elements named name in document order
+    const std::vector<pugi::xml_node>& Find(const std::string& name);
+
+    void Insert(pugi::xml_node root);
+    void Erase(pugi::xml_node root);
+
+  private:
+    struct Postings {
+        std::vector<pugi::xml_node> nodes;
+        bool                        sorted = true;
+    };
+
+    bool                                      built_ = false;
+    std::unordered_map<std::string, Postings> postings_;
+};
+
+// Lookup structures attached to a game document.
+// Indexes are built lazily on first use and have to be told about every change to the document
+// afterwards, which is what XmlIndex::Mutation is for.
+class XmlIndex
+{
+  public:
+    static std::shared_ptr<XmlIndex> Get(const std::shared_ptr<pugi::xml_document>& doc);
+
+    explicit XmlIndex(pugi::xml_document* doc);
+
+    // First <Asset> in document order whose Values/Standard/GUID equals guid
+    pugi::xml_node FindAsset(const std::string& guid);
+    // <Assets> element containing that asset
+    pugi::xml_node FindAssetContainer(const std::string& guid);
+
+    // First <Template> in document order whose Name equals name
+    pugi::xml_node FindTemplate(const std::string& name);
+    // <Templates> element containing that template
+    pugi::xml_node FindTemplateContainer(const std::string& name);
+
+    // Same as above, but every match in document order
+    std::vector<pugi::xml_node> FindAssets(const std::string& guid);
+    std::vector<pugi::xml_node> FindAssetContainers(const std::string& guid);
+    std::vector<pugi::xml_node> FindTemplates(const std::string& name);
+    std::vector<pugi::xml_node> FindTemplateContainers(const std::string& name);
+
+    // Values mods commonly filter on besides the GUID and template name. Like the others these
+    // are built on first use and kept up to date from then on.
+    static const std::vector<XmlIndexDefinition>& SecondaryIndexes();
+    // Elements named element with key_path equal to key in document order. Has to be one of the
+    // secondary indexes.
+    std::vector<pugi::xml_node> FindByKey(const std::string&              element,
+                                          const std::vector<std::string>& key_path,
+                                          const std::string&              key);
+
+    // Assets whose BaseAssetGUID is guid. With recursive also the assets based on those and so
+    // on, i.e. everything inheriting from guid. Follows the BaseAssetGUID index, so the graph
+    // stays current while ops add, remove or re-parent assets.
+    std::vector<pugi::xml_node> FindDerivedAssets(const std::string& guid, bool recursive);
+
+    // Every element named name in document order, builds the name index on first use
+    const std::vector<pugi::xml_node>& FindByName(const std::string& name);
+
+    // Changes whenever the result of one of the Find functions above might
+    size_t Version() const;
+
+    // Remembers full document queries without a match until an element named in them changes
+    bool IsKnownEmpty(const std::string& path) const;
+    void SetKnownEmpty(const std::string& path);
+
+    // Collects the names of all elements added, removed or changed by mutations, including the
+    // ancestors of the changed nodes. Used to find out which batched queries are stale.
+    void                            TrackTouchedNames(bool enable);
+    std::unordered_set<std::string> TakeTouchedNames();
+
+    // Keeps the built indexes in sync with one change to the document.
+    // anchor is the node whose content changes, all its indexed ancestors get re-keyed when the
+    // mutation goes out of scope. Changes deeper down (Merge) are announced with Change, only
+    // the nodes on the way up from those get re-keyed as well.
+    class Mutation
+    {
+      public:
+        Mutation(XmlIndex& index, pugi::xml_node anchor);
+        ~Mutation();
+
+        Mutation(const Mutation&) = delete;
+        Mutation& operator=(const Mutation&) = delete;
+
+        // Has to be called before node is removed from the document
+        void Remove(pugi::xml_node node);
+        // Has to be called after node was inserted into the document
+        void Insert(pugi::xml_node node);
+        // Has to be called before the text or attributes of node change
+        void Change(pugi::xml_node node);
+
+      private:
+        void Record(pugi::xml_node node);
+        void Touch(pugi::xml_node root);
+
+        struct Entry {
+            XmlNodeIndex*  index;
+            pugi::xml_node node;
+            std::string    key;
+        };
+
+        XmlIndex&                                    index_;
+        std::vector<XmlNodeIndex*>                   indexes_;
+        std::vector<Entry>                           entries_;
+        std::unordered_set<pugi::xml_node_struct*>   recorded_; // anchor, its ancestors, Change
+        bool                                         collect_names_ = false;
+        std::unordered_set<std::string>              names_; // Of every element recorded
+    };
+
+  private:
+    std::vector<XmlNodeIndex*> BuiltIndexes();
+
+    const std::vector<pugi::xml_node>* Find(XmlNodeIndex& index, const std::string& key);
+
+    pugi::xml_document*             doc_;
+    XmlNodeIndex                    assets_;
+    XmlNodeIndex                    templates_;
+    std::vector<XmlNodeIndex>       secondary_; // Same order as SecondaryIndexes()
+    XmlNameIndex                    names_;
+    std::unordered_set<std::string> empty_paths_;
+    bool                            track_touched_ = false;
+    std::unordered_set<std::string> touched_names_;
+};
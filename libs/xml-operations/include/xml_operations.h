@@ -1,22 +1,43 @@
 #pragma once
 
+#include "merge_index.h"
 #include "pugixml.hpp"
+#include "xml_index.h"
+#include "xpath_batch.h"
+#include "xpath_shape.h"
 
+#include <cstddef>
 #include <filesystem>
+#include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace fs = std::filesystem;
 
 class XmlOperation
 {
+    friend class OpBundle;
+    friend class RewriteAdvisor;
+
   public:
-    enum Type { None, Add, AddNextSibling, AddPrevSibling, Remove, Replace, Merge };
+    enum Type { None, Add, AddNextSibling, AddPrevSibling, Remove, Replace, Merge, Table };
+
+    // Shared by all ops read from one patch or included file
+    struct Context {
+        std::shared_ptr<pugi::xml_document> doc; // Keeps the nodes of the ops alive
+        std::string                         mod_name;
+        fs::path                            game_path;
+        fs::path                            mod_path;
+        // File the ops were read from, the patch or an include. Empty if they weren't.
+        fs::path                            patch_path;
+    };
 
-    XmlOperation(std::shared_ptr<pugi::xml_document> doc, pugi::xml_node node,
-                 std::string guid = "", std::string temp = "", std::string mod_name = "",
-                 fs::path game_path = {}, fs::path mod_path = {});
+    // guid can list several GUIDs separated by ',', the op is applied to each of them.
+    // offset is where node is in the patch file, if it wasn't parsed from there.
+    XmlOperation(std::shared_ptr<const Context> context, pugi::xml_node node,
+                 std::string guid = "", std::string temp = "", ptrdiff_t offset = -1);
 
     pugi::xml_object_range<pugi::xml_node_iterator> GetContentNode();
     Type                                            GetType() const;
@@ -24,34 +45,63 @@ class XmlOperation
 
     void Apply(std::shared_ptr<pugi::xml_document> doc);
 
+    // Applies operations in order. Ops with a //Name path start from all elements with that name
+    // and share their lookups until a mutation gets in the way.
+    static void ApplyOperations(std::vector<XmlOperation>&          operations,
+                                std::shared_ptr<pugi::xml_document> doc);
+
   public:
+    // includes collects the files pulled in by <Include> and the files of table ops
     static std::vector<XmlOperation> GetXmlOperations(std::shared_ptr<pugi::xml_document> doc,
                                                       std::string mod_name  = "",
                                                       fs::path    game_path = {},
-                                                      fs::path    mod_path  = {});
-    static std::vector<XmlOperation> GetXmlOperationsFromFile(fs::path    path,
-                                                              std::string mod_name  = "",
-                                                              fs::path    game_path = {},
-                                                              fs::path    mod_path  = {});
+                                                      fs::path    mod_path  = {},
+                                                      std::vector<fs::path>* includes = nullptr);
+    static std::vector<XmlOperation>
+    GetXmlOperationsFromFile(fs::path path, std::string mod_name = "", fs::path game_path = {},
+                             fs::path mod_path = {}, std::vector<fs::path>* includes = nullptr);
+    // Included files are parsed once for all patches including them, until this is called
+    static void ClearIncludeCache();
 
   private:
     Type        type_;
     std::string path_;
 
+    std::string path_suffix_;
     std::string speculative_path_;
-    std::string guid_;
-    std::string template_;
 
-    std::optional<pugi::xml_object_range<pugi::xml_node_iterator>> nodes_;
+    std::vector<std::string> guids_;
+    std::string              template_;
+    std::string              base_guid_; // Targets assets inheriting from this GUID
+    bool                     recursive_ = false;
+    std::string              merge_key_; // Merge content children into the ones with this key
+
+    // Value to set below an asset, read from the <Row>s or the file of a table op
+    struct TableRow {
+        std::string guid;
+        std::string path;      // Of the element below the asset, empty for the asset itself
+        std::string attribute; // Set instead of the text if not empty
+        std::string value;
+        size_t      line = 0;  // In the table file, 0 for rows inside the ModOp
+    };
+    std::vector<TableRow> rows_;
+    std::string           table_file_;
 
-    std::shared_ptr<pugi::xml_document> doc_; // This is here to keep the node below alive
-    pugi::xml_node node_;
+    // Full path fallback for GUID ops with the GUID as variable
+    struct GuidQuery {
+        pugi::xpath_variable_set           variables;
+        std::unique_ptr<pugi::xpath_query> query;
+    };
+    std::shared_ptr<GuidQuery> guid_query_;
 
-    bool           skip_ = false;
+    std::optional<pugi::xml_object_range<pugi::xml_node_iterator>> nodes_;
+    pugi::xml_node staging_; // Imported content shared by the GUIDs being applied
 
-    std::string mod_name_;
-    fs::path    game_path_;
-    fs::path    mod_path_;
+    std::shared_ptr<const Context> context_;
+    pugi::xml_node                 node_;
+    ptrdiff_t                      offset_ = -1; // Of node_ in the patch file
+
+    bool skip_ = false;
 
     enum SpeculativePathType {
         NONE,
@@ -59,27 +109,71 @@ class XmlOperation
         ASSET_CONTAINER,
         SINGLE_TEMPLATE,
         TEMPLATE_CONTAINER,
+        KEYED,
+        DERIVED_ASSETS,
     };
 
     SpeculativePathType speculative_path_type_ = SpeculativePathType::NONE;
 
+    // Set when the GUID or template was taken from Path, the steps leading up to it still have to
+    // be checked for every candidate
+    std::optional<XPathShape>  shape_;
+    std::optional<XPathAnchor> anchor_;
+    size_t                     anchor_step_ = 0;
+    // Nothing outside of the speculative lookup can match
+    bool authoritative_ = false;
+
+    static std::vector<XmlOperation> GetXmlOperations(std::shared_ptr<const Context> context,
+                                                      std::vector<fs::path>*         includes);
+
     static std::string GetXmlPropString(pugi::xml_node node, std::string prop_name)
     {
         return node.attribute(prop_name.c_str()).as_string();
     }
-    void RecursiveMerge(pugi::xml_node root_game_node, pugi::xml_node game_node,
+    void RecursiveMerge(XmlIndex::Mutation& mutation, MergeIndex& index,
+                        pugi::xml_node root_game_node, pugi::xml_node game_node,
                         pugi::xml_node patching_node);
-    void ReadPath(pugi::xml_node node, std::string guid = "", std::string temp = "");
-    void ReadType(pugi::xml_node node, std::string mod_name, fs::path game_path, fs::path mod_path);
-
-    std::optional<pugi::xml_node> FindAsset(std::string guid, pugi::xml_node node);
-    std::optional<pugi::xml_node> FindTemplate(std::string temp, pugi::xml_node node);
-
-    std::optional<pugi::xml_node> FindAsset(std::shared_ptr<pugi::xml_document> doc,
-                                            std::string                         guid);
-    std::optional<pugi::xml_node> FindTemplate(std::shared_ptr<pugi::xml_document> doc,
-                                               std::string                         temp);
-
-    pugi::xpath_node_set ReadGuidNodes(std::shared_ptr<pugi::xml_document> doc);
-    pugi::xpath_node_set ReadTemplateNodes(std::shared_ptr<pugi::xml_document> doc);
+    void MergeByKey(XmlIndex& index, pugi::xml_node game_node);
+    // Copy of the content as children of a new node at the end of doc, the caller removes it
+    pugi::xml_node ImportContent(pugi::xml_document& doc);
+    void ReadPath(pugi::xml_node node, std::string temp = "");
+    void ReadType(pugi::xml_node node);
+    void ReadTable(pugi::xml_node node);
+    // Next to the file the op was read from
+    fs::path TableFilePath() const;
+    void AddTableRow(std::string guid, std::string_view path, std::string value, size_t line);
+    // Sets every row through the GUID index, there is no path to look up
+    void ApplyTable(std::shared_ptr<pugi::xml_document> doc);
+
+    // targets are the nodes FindTargets returned for this op, looked up again if not given
+    void        Apply(std::shared_ptr<pugi::xml_document> doc, const std::string& guid,
+                      const std::vector<pugi::xml_node>* targets = nullptr);
+    void        Apply(std::shared_ptr<pugi::xml_document> doc, const std::string& guid,
+                      const pugi::xpath_node_set& results);
+    std::string GetPath(const std::string& guid);
+
+    // Neither GUID, template nor index anchor, the full path has to be searched
+    bool IsBatchable() const;
+
+    // Index entries the speculative path is evaluated on
+    std::vector<pugi::xml_node> FindTargets(XmlIndex& index, const std::string& guid);
+    // Identifies what FindTargets returns, empty for ops without a single speculative lookup
+    std::string TargetKey() const;
+    // Roots of the subtrees the op reads and changes when applied to targets. No value if that
+    // isn't known before applying it, i.e. it might depend on or affect any other op.
+    std::optional<std::vector<pugi::xml_node>>
+    Footprint(const std::vector<pugi::xml_node>& targets) const;
+
+    const std::string& FirstGuid() const;
+    // How ReadSpeculativeNodes finds the targets, for the profiler
+    const char* SpeculativeLookupName() const;
+
+    // Resolves the op through XmlIndex, no value means the full path has to be evaluated
+    std::optional<pugi::xpath_node_set>
+    ReadSpeculativeNodes(std::shared_ptr<pugi::xml_document> doc, const std::string& guid,
+                         const std::vector<pugi::xml_node>* targets = nullptr);
+    pugi::xpath_node_set ReadFullPathNodes(std::shared_ptr<pugi::xml_document> doc,
+                                           const std::string&                  guid);
+    pugi::xpath_node_set ReadNodes(std::shared_ptr<pugi::xml_document> doc, const std::string& guid,
+                                   const std::vector<pugi::xml_node>* targets = nullptr);
 };
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "pugixml.hpp"
+#include "xml_index.h"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+class XPathShape;
+
+// Evaluates queries of the form //Name[predicates]/rest starting from the elements XmlIndex
+// knows by that name instead of searching the whole document.
+// A pass over the name lists collects the nodes matching the first step of every pending query,
+// the rest of the path is evaluated on those when the results are asked for. A query only needs
+// another pass if an element with its first step's name was added, removed or changed since, see
+// Invalidate. Queries whose predicates look outside of the candidate get a pass every time.
+class XPathBatch
+{
+  public:
+    constexpr static size_t npos = static_cast<size_t>(-1);
+
+    // Registers a query, returns npos if path can't be evaluated as part of a batch
+    size_t Add(const std::string& path);
+    // Whether Add takes a path of that shape, the path may still fail to compile
+    static bool Accepts(const XPathShape& shape);
+
+    // Results of query id in document order, same as select_nodes(path) on the document.
+    // Does one pass for all pending queries that have no valid matches.
+    pugi::xpath_node_set Select(XmlIndex& index, size_t id);
+    // Query id won't be selected again
+    void Release(size_t id);
+
+    // Forgets the matches of every query whose first step selects one of names
+    void Invalidate(const std::unordered_set<std::string>& names);
+
+    size_t Passes() const;
+
+  private:
+    struct Query {
+        std::string                                           name;
+        std::vector<std::shared_ptr<const pugi::xpath_query>> predicates;
+        std::shared_ptr<const pugi::xpath_query>              rest; // nullptr if there is none
+
+        bool                        local   = true;
+        size_t                      pending = 0;
+        bool                        valid   = false;
+        std::vector<pugi::xml_node> matches;
+    };
+
+    void Pass(XmlIndex& index, size_t id);
+
+    std::vector<Query>                      queries_;
+    std::unordered_map<std::string, size_t> ids_;
+    size_t                                  passes_ = 0;
+};
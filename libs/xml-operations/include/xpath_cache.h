@@ -0,0 +1,43 @@
+#pragma once
+
+#include "pugixml.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Process wide cache of compiled XPath expressions.
+// Mods tend to reuse the same (relative) paths a lot, compiling them once is enough.
+class XPathCache
+{
+  public:
+    static XPathCache& instance()
+    {
+        static XPathCache instance;
+        return instance;
+    }
+
+    // Throws pugi::xpath_exception if expression doesn't compile, failures aren't cached
+    std::shared_ptr<const pugi::xpath_query> Get(const std::string& expression);
+
+    size_t Hits() const;
+    size_t Misses() const;
+
+  private:
+    XPathCache() = default;
+
+    using Entry = std::pair<std::string, std::shared_ptr<const pugi::xpath_query>>;
+
+    // Full paths with an embedded GUID are rarely reused, keep the cache bounded
+    constexpr static size_t MAX_ENTRIES = 4096;
+
+    std::mutex                                                  mutex_;
+    std::list<Entry>                                            entries_;
+    std::unordered_map<std::string, std::list<Entry>::iterator> lookup_;
+    std::atomic<size_t>                                         hits_   = 0;
+    std::atomic<size_t>                                         misses_ = 0;
+};
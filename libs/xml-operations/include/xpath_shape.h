@@ -0,0 +1,74 @@
+#pragma once
+
+#include "pugixml.hpp"
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Structure of the location paths mods write, e.g.
+// /Templates/Group[Name='Objects']/Template[Name = "Residence7"]/Properties
+// This only splits the path into steps, predicates are kept as text and left to pugixml.
+struct XPathStep {
+    bool                     descendant = false; // Step was preceded by '//'
+    std::string              test;               // Node test including the axis, e.g. Asset or @ID
+    std::vector<std::string> predicates;         // Predicate expressions without the brackets
+
+    // Plain element name or '*' on the child axis
+    bool IsElementTest() const;
+    bool Matches(pugi::xml_node node) const;
+};
+
+// Predicate of the form `Child/Path = 'literal'` (either side, either quote)
+struct XPathEquality {
+    std::vector<std::string> path;
+    std::string              value;
+
+    static std::optional<XPathEquality> Parse(std::string_view predicate);
+};
+
+// A step that can be resolved through XmlIndex instead of searching the document
+struct XPathAnchor {
+    enum Kind {
+        ASSET,              // Asset[Values/Standard/GUID='X']
+        ASSET_CONTAINER,    // Assets[Asset/Values/Standard/GUID='X']
+        TEMPLATE,           // Template[Name='X']
+        TEMPLATE_CONTAINER, // Templates[Template/Name='X']
+        KEYED,              // One of XmlIndex::SecondaryIndexes(), e.g. Asset[Template='X']
+    };
+
+    Kind                     kind;
+    std::string              element;
+    std::vector<std::string> key_path;
+    std::string              key;
+    size_t                   step;
+    std::string              relative_path; // Remaining steps relative to the anchor node
+};
+
+class XPathShape
+{
+  public:
+    static std::optional<XPathShape> Parse(std::string_view path);
+
+    bool                         IsAbsolute() const;
+    const std::vector<XPathStep>& Steps() const;
+
+    // Steps starting at first rendered as path relative to the node matched by the step before
+    std::string RelativePath(size_t first) const;
+
+    // Last step that can be resolved through an index, if everything leading up to it can be
+    // checked on the candidate node and its ancestors alone
+    std::optional<XPathAnchor> FindAnchor() const;
+
+    // Whether node is selected by the steps up to and including step
+    bool Matches(size_t step, pugi::xml_node node) const;
+
+    static bool IsPositional(std::string_view predicate);
+    // Whether expression only looks at the context node and its descendants
+    static bool IsLocal(std::string_view expression);
+
+  private:
+    bool                   absolute_ = false;
+    std::vector<XPathStep> steps_;
+};
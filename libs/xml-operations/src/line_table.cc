@@ -0,0 +1,72 @@
+#include "line_table.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+
+LineTable::LineTable(std::string_view data)
+    : size_(data.size())
+{
+    // memchr is vectorized by the C runtime, much faster than looking at every byte here
+    const char* begin = data.data();
+    const char* end   = begin + data.size();
+    for (const char* newline = begin;
+         (newline = static_cast<const char*>(std::memchr(newline, '\n', end - newline)));
+         ++newline) {
+        newlines_.push_back(newline - begin);
+    }
+}
+
+std::pair<size_t, size_t> LineTable::Location(ptrdiff_t offset) const
+{
+    if (offset < 0 || static_cast<size_t>(offset) > size_) {
+        return {0, 0};
+    }
+    const size_t index =
+        std::lower_bound(newlines_.begin(), newlines_.end(), offset) - newlines_.begin();
+    return {1 + index, index == 0 ? offset + 1 : offset - newlines_[index - 1]};
+}
+
+size_t LineTable::Line(ptrdiff_t offset) const
+{
+    return Location(offset).first;
+}
+
+std::shared_ptr<const LineTable> LineTable::ForFile(const fs::path& path)
+{
+    struct Entry {
+        fs::file_time_type               write_time;
+        std::shared_ptr<const LineTable> table;
+    };
+    static std::mutex                             mutex;
+    static std::unordered_map<std::string, Entry> entries;
+
+    std::error_code ec;
+    const auto      write_time = fs::last_write_time(path, ec);
+    const auto      key        = path.lexically_normal().generic_string();
+    {
+        std::scoped_lock lk{mutex};
+        auto it = entries.find(key);
+        if (it != entries.end() && it->second.write_time == write_time) {
+            return it->second.table;
+        }
+    }
+
+    // Directories open fine on some platforms, their size is garbage
+    std::string data;
+    if (fs::is_regular_file(path, ec)) {
+        const auto    size = fs::file_size(path, ec);
+        std::ifstream file(path, std::ios::binary);
+        if (!ec && file) {
+            data.resize(size);
+            file.read(data.data(), data.size());
+            data.resize(file.gcount());
+        }
+    }
+    auto table = std::make_shared<const LineTable>(data);
+
+    std::scoped_lock lk{mutex};
+    entries[key] = {write_time, table};
+    return table;
+}
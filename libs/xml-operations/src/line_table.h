@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Turns offsets into a file (e.g. from offset_debug()) into lines
+class LineTable
+{
+  public:
+    explicit LineTable(std::string_view data);
+
+    // Line and column of offset, both starting at 1. Zero for offsets outside of the data.
+    std::pair<size_t, size_t> Location(ptrdiff_t offset) const;
+    size_t                    Line(ptrdiff_t offset) const;
+
+    // Table of the file at path. Every file is only read and scanned once, until it changes.
+    static std::shared_ptr<const LineTable> ForFile(const fs::path& path);
+
+  private:
+    size_t                 size_;
+    std::vector<ptrdiff_t> newlines_;
+};
+
+// Lines of offsets in any number of files, asks ForFile once per file
+class LineLookup
+{
+  public:
+    size_t Line(const fs::path& file, ptrdiff_t offset)
+    {
+        auto& table = tables_[file.string()];
+        if (!table) {
+            table = LineTable::ForFile(file);
+        }
+        return table->Line(offset);
+    }
+
+  private:
+    std::unordered_map<std::string, std::shared_ptr<const LineTable>> tables_;
+};
@@ -0,0 +1,50 @@
+#include "merge_index.h"
+
+#include <algorithm>
+#include <cstring>
+
+pugi::xml_node MergeIndex::FindFrom(pugi::xml_node node, const char* name)
+{
+    if (!node) {
+        return {};
+    }
+    const auto parent = node.parent();
+    if (auto it = levels_.find(parent.internal_object()); it != levels_.end()) {
+        return FindFrom(it->second, node, name);
+    }
+
+    size_t scanned = 0;
+    for (auto cur_node = node; cur_node; cur_node = cur_node.next_sibling()) {
+        if (std::strcmp(cur_node.name(), name) == 0) {
+            return cur_node;
+        }
+        if (++scanned > THRESHOLD) {
+            return FindFrom(Build(parent), cur_node, name);
+        }
+    }
+    return {};
+}
+
+MergeIndex::Level& MergeIndex::Build(pugi::xml_node parent)
+{
+    auto& level = levels_[parent.internal_object()];
+    for (auto child : parent.children()) {
+        level.positions.emplace(child.internal_object(), level.children.size());
+        level.by_name[child.name()].push_back(level.children.size());
+        level.children.push_back(child);
+    }
+    return level;
+}
+
+pugi::xml_node MergeIndex::FindFrom(const Level& level, pugi::xml_node node,
+                                    const char* name) const
+{
+    auto it = level.by_name.find(name);
+    if (it == level.by_name.end()) {
+        return {};
+    }
+    const auto& positions = it->second;
+    const auto  position  = level.positions.at(node.internal_object());
+    auto        found     = std::lower_bound(positions.begin(), positions.end(), position);
+    return found == positions.end() ? pugi::xml_node{} : level.children[*found];
+}
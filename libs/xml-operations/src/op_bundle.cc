@@ -0,0 +1,227 @@
+#include "op_bundle.h"
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+
+namespace
+{
+constexpr char     MAGIC[4] = {'A', 'O', 'P', 'B'};
+constexpr uint32_t VERSION  = 2;
+
+// Everything is stored in the byte order of the machine, bundles never leave it
+class Writer
+{
+  public:
+    template <typename T> void Put(T value)
+    {
+        data_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    void Put(std::string_view value)
+    {
+        Put(static_cast<uint32_t>(value.size()));
+        data_.append(value.data(), value.size());
+    }
+
+    void Put(pugi::xml_node node)
+    {
+        Put(static_cast<uint8_t>(node.type()));
+        Put(std::string_view{node.name()});
+        Put(std::string_view{node.value()});
+
+        uint32_t attributes = 0;
+        for ([[maybe_unused]] auto attribute : node.attributes()) {
+            attributes++;
+        }
+        Put(attributes);
+        for (auto attribute : node.attributes()) {
+            Put(std::string_view{attribute.name()});
+            Put(std::string_view{attribute.value()});
+        }
+
+        uint32_t children = 0;
+        for ([[maybe_unused]] auto child : node.children()) {
+            children++;
+        }
+        Put(children);
+        for (auto child : node.children()) {
+            Put(child);
+        }
+    }
+
+    std::string Take()
+    {
+        return std::move(data_);
+    }
+
+  private:
+    std::string data_;
+};
+
+class Reader
+{
+  public:
+    explicit Reader(std::string_view data)
+        : data_(data)
+    {
+    }
+
+    template <typename T> bool Get(T& value)
+    {
+        if (data_.size() < sizeof(value)) {
+            return false;
+        }
+        std::memcpy(&value, data_.data(), sizeof(value));
+        data_.remove_prefix(sizeof(value));
+        return true;
+    }
+
+    bool Get(std::string& value)
+    {
+        uint32_t size = 0;
+        if (!Get(size) || data_.size() < size) {
+            return false;
+        }
+        value.assign(data_.data(), size);
+        data_.remove_prefix(size);
+        return true;
+    }
+
+    // Appends the node to parent
+    bool Get(pugi::xml_node parent)
+    {
+        uint8_t     type = 0;
+        std::string name, value;
+        if (!Get(type) || !Get(name) || !Get(value) || type <= pugi::node_document
+            || type > pugi::node_doctype) {
+            return false;
+        }
+        auto node = parent.append_child(static_cast<pugi::xml_node_type>(type));
+        if (!name.empty()) {
+            node.set_name(name.c_str());
+        }
+        if (!value.empty()) {
+            node.set_value(value.c_str());
+        }
+
+        uint32_t attributes = 0;
+        if (!Get(attributes)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < attributes; ++i) {
+            if (!Get(name) || !Get(value)) {
+                return false;
+            }
+            node.append_attribute(name.c_str()).set_value(value.c_str());
+        }
+
+        uint32_t children = 0;
+        if (!Get(children)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < children; ++i) {
+            if (!Get(node)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool Header()
+    {
+        char     magic[sizeof(MAGIC)];
+        uint32_t version = 0;
+        return Get(magic) && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0 && Get(version)
+               && version == VERSION;
+    }
+
+    std::optional<OpBundle::Dependencies> Dependencies()
+    {
+        uint32_t count = 0;
+        if (!Get(count)) {
+            return {};
+        }
+        OpBundle::Dependencies dependencies(count);
+        for (auto& [path, hash] : dependencies) {
+            if (!Get(path) || !Get(hash)) {
+                return {};
+            }
+        }
+        return dependencies;
+    }
+
+  private:
+    std::string_view data_;
+};
+} // namespace
+
+std::string OpBundle::Write(const std::vector<XmlOperation>& operations,
+                            const Dependencies&              dependencies)
+{
+    Writer writer;
+    for (auto c : MAGIC) {
+        writer.Put(c);
+    }
+    writer.Put(VERSION);
+
+    writer.Put(static_cast<uint32_t>(dependencies.size()));
+    for (const auto& [path, hash] : dependencies) {
+        writer.Put(std::string_view{path});
+        writer.Put(std::string_view{hash});
+    }
+
+    writer.Put(static_cast<uint32_t>(operations.size()));
+    for (const auto& operation : operations) {
+        writer.Put(std::string_view{operation.context_->patch_path.string()});
+        writer.Put(static_cast<int64_t>(operation.offset_));
+        writer.Put(operation.node_);
+    }
+    return writer.Take();
+}
+
+std::optional<OpBundle::Dependencies> OpBundle::ReadDependencies(std::string_view data)
+{
+    Reader reader(data);
+    if (!reader.Header()) {
+        return {};
+    }
+    return reader.Dependencies();
+}
+
+std::optional<std::vector<XmlOperation>> OpBundle::Read(std::string_view data,
+                                                        std::string mod_name, fs::path game_path,
+                                                        fs::path mod_path)
+{
+    Reader reader(data);
+    uint32_t count = 0;
+    if (!reader.Header() || !reader.Dependencies() || !reader.Get(count)) {
+        return {};
+    }
+
+    auto doc  = std::make_shared<pugi::xml_document>();
+    auto root = doc->append_child("ModOps");
+    // One per file the ops were read from, like GetXmlOperations does
+    std::map<std::string, std::shared_ptr<const XmlOperation::Context>> contexts;
+
+    std::vector<XmlOperation> operations;
+    operations.reserve(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        std::string patch_path;
+        int64_t     offset = -1;
+        if (!reader.Get(patch_path) || !reader.Get(offset) || !reader.Get(root)) {
+            return {};
+        }
+        auto& context = contexts[patch_path];
+        if (!context) {
+            context = std::make_shared<const XmlOperation::Context>(
+                XmlOperation::Context{doc, mod_name, game_path, mod_path, patch_path});
+        }
+        // Same as GetXmlOperations, GUID wins over Template
+        auto       node = root.last_child();
+        const auto guid = node.attribute("GUID").as_string();
+        const auto temp = *guid ? "" : node.attribute("Template").as_string();
+        operations.emplace_back(context, node, guid, temp, static_cast<ptrdiff_t>(offset));
+    }
+    return operations;
+}
@@ -0,0 +1,142 @@
+#include "op_profiler.h"
+#include "line_table.h"
+
+#include "nlohmann/json.hpp"
+#include "spdlog/spdlog.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <numeric>
+#include <unordered_map>
+
+namespace
+{
+double Milliseconds(OpProfiler::Clock::duration duration)
+{
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+double Microseconds(OpProfiler::Clock::duration duration)
+{
+    return std::chrono::duration<double, std::micro>(duration).count();
+}
+
+// Line of every sample
+std::vector<size_t> GetLines(const std::vector<OpProfiler::Sample>& samples)
+{
+    LineLookup          lookup;
+    std::vector<size_t> lines;
+    lines.reserve(samples.size());
+    for (const auto& sample : samples) {
+        lines.push_back(lookup.Line(sample.patch_path, sample.offset));
+    }
+    return lines;
+}
+} // namespace
+
+void OpProfiler::Enable(bool enabled)
+{
+    std::scoped_lock lk{mutex_};
+    if (enabled) {
+        samples_.clear();
+        origin_ = Clock::now();
+    }
+    enabled_ = enabled;
+}
+
+void OpProfiler::Add(Sample sample)
+{
+    std::scoped_lock lk{mutex_};
+    samples_.push_back(std::move(sample));
+}
+
+void OpProfiler::LogSummary(size_t count) const
+{
+    std::scoped_lock lk{mutex_};
+    if (samples_.empty()) {
+        return;
+    }
+    const auto total = [](const Sample& sample) { return sample.lookup_time + sample.apply_time; };
+
+    std::vector<size_t> order(samples_.size());
+    std::iota(order.begin(), order.end(), 0);
+    count = std::min(count, order.size());
+    std::partial_sort(order.begin(), order.begin() + count, order.end(), [&](size_t l, size_t r) {
+        return total(samples_[l]) > total(samples_[r]);
+    });
+
+    Clock::duration time{};
+    for (const auto& sample : samples_) {
+        time += total(sample);
+    }
+    spdlog::info("Applied {} ops in {:.1f} ms, the {} slowest:", samples_.size(),
+                 Milliseconds(time), count);
+    const auto lines = GetLines(samples_);
+    for (size_t i = 0; i < count; ++i) {
+        const auto& sample = samples_[order[i]];
+        spdlog::info("{:9.2f} ms [{}] {} {} ({}:{}) lookup by {}{} {:.2f} ms, apply {:.2f} ms, "
+                     "{} matches, {} nodes copied",
+                     Milliseconds(total(sample)), sample.mod_name, sample.type, sample.path,
+                     sample.patch_path.string(), lines[order[i]], sample.lookup,
+                     sample.prefetched ? " (prefetched)" : "", Milliseconds(sample.lookup_time),
+                     Milliseconds(sample.apply_time), sample.matches, sample.copied);
+    }
+
+    std::map<std::string, std::pair<size_t, Clock::duration>> lookups;
+    for (const auto& sample : samples_) {
+        auto& [ops, lookup_time] = lookups[sample.lookup];
+        ops++;
+        lookup_time += sample.lookup_time;
+    }
+    for (const auto& [lookup, stats] : lookups) {
+        spdlog::info("{} ops looked up by {} in {:.1f} ms", stats.first, lookup,
+                     Milliseconds(stats.second));
+    }
+}
+
+bool OpProfiler::WriteTrace(const fs::path& path) const
+{
+    std::scoped_lock lk{mutex_};
+    const auto       lines = GetLines(samples_);
+
+    // A track per mod
+    std::unordered_map<std::string, size_t> tracks;
+    auto                                    events = nlohmann::json::array();
+    for (size_t i = 0; i < samples_.size(); ++i) {
+        const auto& sample      = samples_[i];
+        auto [track, new_track] = tracks.emplace(sample.mod_name, tracks.size() + 1);
+        if (new_track) {
+            events.push_back({{"name", "thread_name"},
+                              {"ph", "M"},
+                              {"pid", 1},
+                              {"tid", track->second},
+                              {"args", {{"name", sample.mod_name}}}});
+        }
+        events.push_back({{"name", sample.type + " " + sample.path},
+                          {"cat", sample.lookup},
+                          {"ph", "X"},
+                          {"pid", 1},
+                          {"tid", track->second},
+                          {"ts", Microseconds(sample.start - origin_)},
+                          {"dur", Microseconds(sample.lookup_time + sample.apply_time)},
+                          {"args",
+                           {{"mod", sample.mod_name},
+                            {"file", sample.patch_path.string()},
+                            {"line", lines[i]},
+                            {"lookup", sample.lookup},
+                            {"prefetched", sample.prefetched},
+                            {"lookup_us", Microseconds(sample.lookup_time)},
+                            {"apply_us", Microseconds(sample.apply_time)},
+                            {"matches", sample.matches},
+                            {"copied", sample.copied}}}});
+    }
+
+    std::ofstream file(path);
+    if (!file) {
+        spdlog::error("Failed to write op profile {}", path.string());
+        return false;
+    }
+    file << nlohmann::json{{"traceEvents", std::move(events)}, {"displayTimeUnit", "ms"}};
+    return true;
+}
@@ -0,0 +1,326 @@
+#include "rewrite_advisor.h"
+#include "line_table.h"
+#include "xml_index.h"
+#include "xpath_batch.h"
+#include "xpath_shape.h"
+
+#include "absl/strings/str_split.h"
+#include "spdlog/spdlog.h"
+
+#include <cctype>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string_view>
+
+namespace
+{
+// Elements in the subtree of root, without root
+size_t CountElements(pugi::xml_node root)
+{
+    size_t count = 0;
+    auto   node  = root.first_child();
+    while (node) {
+        count += node.type() == pugi::node_element;
+        if (node.first_child()) {
+            node = node.first_child();
+            continue;
+        }
+        while (node != root && !node.next_sibling()) {
+            node = node.parent();
+        }
+        node = node == root ? pugi::xml_node{} : node.next_sibling();
+    }
+    return count;
+}
+
+// Whether the operator `or` starts at i, as in A='1' or B='2'
+bool IsOr(std::string_view predicate, size_t i)
+{
+    if (i == 0 || i + 2 >= predicate.size() || predicate.substr(i, 2) != "or") {
+        return false;
+    }
+    const char before = predicate[i - 1];
+    return (isspace(static_cast<unsigned char>(before)) || before == '\'' || before == '"')
+           && isspace(static_cast<unsigned char>(predicate[i + 2]));
+}
+
+// Splits a predicate at the `or`s outside of literals and brackets
+std::vector<std::string_view> SplitOr(std::string_view predicate)
+{
+    std::vector<std::string_view> parts;
+    char                          quote = 0;
+    int                           depth = 0;
+    size_t                        start = 0;
+    for (size_t i = 0; i < predicate.size(); ++i) {
+        const char c = predicate[i];
+        if (quote) {
+            quote = c == quote ? 0 : quote;
+        } else if (c == '\'' || c == '"') {
+            quote = c;
+        } else if (c == '(' || c == '[') {
+            depth++;
+        } else if (c == ')' || c == ']') {
+            depth--;
+        } else if (depth == 0 && IsOr(predicate, i)) {
+            parts.push_back(predicate.substr(start, i - start));
+            start = i + 2;
+        }
+    }
+    parts.push_back(predicate.substr(start));
+    return parts;
+}
+
+std::string EscapeAttribute(std::string_view value, char quote)
+{
+    std::string escaped;
+    for (const char c : value) {
+        switch (c) {
+            case '&':
+                escaped += "&amp;";
+                break;
+            case '<':
+                escaped += "&lt;";
+                break;
+            case '"':
+                escaped += quote == '"' ? "&quot;" : "\"";
+                break;
+            case '\'':
+                escaped += quote == '\'' ? "&apos;" : "'";
+                break;
+            default:
+                escaped += c;
+        }
+    }
+    return escaped;
+}
+
+// Puts GUID in front of the Path attribute of the start tag whose name is at offset and replaces
+// the value of Path, with the quotes Path had. Everything else in data stays as it was.
+bool SpliceRewrite(std::string& data, size_t offset,
+                   const std::pair<std::string, std::string>& rewrite)
+{
+    size_t i = offset;
+    while (i < data.size() && !isspace(static_cast<unsigned char>(data[i])) && data[i] != '>'
+           && data[i] != '/') {
+        i++;
+    }
+    while (i < data.size()) {
+        while (i < data.size() && isspace(static_cast<unsigned char>(data[i]))) {
+            i++;
+        }
+        const size_t name = i;
+        while (i < data.size() && !isspace(static_cast<unsigned char>(data[i])) && data[i] != '='
+               && data[i] != '>' && data[i] != '/') {
+            i++;
+        }
+        const auto attribute = std::string_view{data}.substr(name, i - name);
+        while (i < data.size() && isspace(static_cast<unsigned char>(data[i]))) {
+            i++;
+        }
+        if (attribute.empty() || i == data.size() || data[i] != '=') {
+            return false;
+        }
+        i++;
+        while (i < data.size() && isspace(static_cast<unsigned char>(data[i]))) {
+            i++;
+        }
+        if (i == data.size() || (data[i] != '"' && data[i] != '\'')) {
+            return false;
+        }
+        const char   quote = data[i];
+        const size_t value = i + 1;
+        const size_t end   = data.find(quote, value);
+        if (end == std::string::npos) {
+            return false;
+        }
+        if (attribute == "Path") {
+            data.replace(value, end - value, EscapeAttribute(rewrite.second, quote));
+            data.insert(name, "GUID=" + std::string(1, quote)
+                                  + EscapeAttribute(rewrite.first, quote) + quote + " ");
+            return true;
+        }
+        i = end + 1;
+    }
+    return false;
+}
+} // namespace
+
+std::optional<std::pair<std::string, std::string>>
+RewriteAdvisor::ProposeRewrite(const XmlOperation& operation)
+{
+    if (operation.skip_ || operation.type_ == XmlOperation::Type::None
+        || operation.type_ == XmlOperation::Type::Table
+        || operation.speculative_path_type_ != XmlOperation::SpeculativePathType::NONE) {
+        return {};
+    }
+    const auto shape = XPathShape::Parse(operation.path_);
+    if (!shape || !shape->IsAbsolute()) {
+        return {};
+    }
+
+    // The GUID predicate may also sit on an element below the asset, e.g. Values[Standard/GUID=1]
+    static const std::vector<std::string> guid_path = {"Asset", "Values", "Standard", "GUID"};
+    const auto&                           steps     = shape->Steps();
+    for (size_t i = 0; i < steps.size(); ++i) {
+        const auto& step = steps[i];
+        if (step.predicates.empty()) {
+            continue;
+        }
+        // Anything filtering before the GUID would be lost
+        if (step.predicates.size() > 1 || !step.IsElementTest()) {
+            return {};
+        }
+        size_t depth = 0;
+        while (depth + 1 < guid_path.size() && guid_path[depth] != step.test) {
+            depth++;
+        }
+        if (depth + 1 == guid_path.size()
+            || (depth > 0 && !step.descendant
+                && (i == 0 || steps[i - 1].test != guid_path[depth - 1]))) {
+            return {};
+        }
+        const std::vector<std::string> key_path(guid_path.begin() + depth + 1, guid_path.end());
+
+        std::string guids;
+        for (auto part : SplitOr(step.predicates.front())) {
+            auto equality = XPathEquality::Parse(part);
+            if (!equality || equality->path != key_path
+                || equality->value.find(',') != std::string::npos) {
+                return {};
+            }
+            guids += (guids.empty() ? "" : ",") + equality->value;
+        }
+
+        std::string path;
+        for (size_t j = 1; j <= depth; ++j) {
+            path += "/" + guid_path[j];
+        }
+        const auto rest = shape->RelativePath(i + 1);
+        if (rest.substr(0, 3) == ".//") {
+            path += rest.substr(1);
+        } else if (!rest.empty()) {
+            path += "/" + rest;
+        }
+        return std::make_pair(guids, path.empty() ? "/" : path);
+    }
+    return {};
+}
+
+std::vector<RewriteAdvisor::Advice>
+RewriteAdvisor::Analyse(const std::vector<XmlOperation>&    operations,
+                        std::shared_ptr<pugi::xml_document> doc)
+{
+    auto         index    = XmlIndex::Get(doc);
+    const size_t elements = CountElements(*doc);
+
+    std::vector<Advice> advice;
+    advice.reserve(operations.size());
+    for (size_t i = 0; i < operations.size(); ++i) {
+        const auto& operation = operations[i];
+        Advice      entry;
+        entry.operation = i;
+        if (operation.skip_ || operation.type_ == XmlOperation::Type::None) {
+            entry.lookup = "skipped";
+        } else if (operation.type_ == XmlOperation::Type::Table) {
+            entry.lookup = "table rows";
+        } else if (operation.speculative_path_type_ != XmlOperation::SpeculativePathType::NONE) {
+            entry.lookup = operation.SpeculativeLookupName();
+        } else if (auto shape = XPathShape::Parse(operation.path_);
+                   operation.IsBatchable() && shape && XPathBatch::Accepts(*shape)) {
+            // Starts from the elements named like the first step
+            entry.lookup  = "name index";
+            entry.scanned = index->FindByName(shape->Steps().front().test).size();
+        } else {
+            entry.lookup  = "full path";
+            entry.scanned = elements;
+        }
+
+        entry.rewrite = ProposeRewrite(operation);
+        if (entry.rewrite) {
+            std::vector<std::string> guids = absl::StrSplit(entry.rewrite->first, ',');
+            for (const auto& guid : guids) {
+                if (auto asset = index->FindAsset(guid); asset) {
+                    entry.scanned_rewritten += 1 + CountElements(asset);
+                }
+            }
+        }
+        advice.push_back(std::move(entry));
+    }
+    return advice;
+}
+
+void RewriteAdvisor::Log(const std::vector<XmlOperation>& operations,
+                         const std::vector<Advice>&       advice)
+{
+    LineLookup                    lines;
+    std::map<std::string, size_t> lookups;
+    size_t                        rewrites = 0;
+    size_t                        saved    = 0;
+    for (const auto& entry : advice) {
+        const auto& operation = operations[entry.operation];
+        const auto& context   = *operation.context_;
+        lookups[entry.lookup]++;
+        const auto line = lines.Line(context.patch_path, operation.offset_);
+        if (entry.rewrite) {
+            rewrites++;
+            saved += entry.scanned - std::min(entry.scanned, entry.scanned_rewritten);
+            spdlog::info("[{}] {}:{} {} searches by {}, use GUID='{}' Path='{}' instead (~{} "
+                         "instead of ~{} nodes)",
+                         context.mod_name, context.patch_path.string(), line, operation.path_,
+                         entry.lookup, entry.rewrite->first, entry.rewrite->second,
+                         entry.scanned_rewritten, entry.scanned);
+        } else if (entry.lookup == "full path") {
+            spdlog::info("[{}] {}:{} {} searches the whole file (~{} nodes)", context.mod_name,
+                         context.patch_path.string(), line, operation.path_, entry.scanned);
+        }
+    }
+    for (const auto& [lookup, count] : lookups) {
+        spdlog::info("{} ops look up their targets by {}", count, lookup);
+    }
+    if (rewrites > 0) {
+        spdlog::info("{} ops can use the GUID index, saving ~{} node visits per pass", rewrites,
+                     saved);
+    }
+}
+
+bool RewriteAdvisor::WriteRewritten(const std::vector<XmlOperation>& operations,
+                                    const std::vector<Advice>& advice, const fs::path& patch_path,
+                                    const fs::path& path)
+{
+    // The file is changed as text, line endings, indentation and comments stay as they are
+    std::string data;
+    {
+        std::ifstream file(patch_path, std::ios::binary);
+        if (!file) {
+            spdlog::error("Failed to read {}", patch_path.string());
+            return false;
+        }
+        data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
+    // Ops are found by where their start tag is in the file, ops read from includes are skipped.
+    // Splicing goes from the end of the file, so the offsets before stay valid.
+    const auto file = patch_path.lexically_normal();
+    std::map<ptrdiff_t, const std::pair<std::string, std::string>*> rewrites;
+    for (const auto& entry : advice) {
+        const auto& operation = operations[entry.operation];
+        if (entry.rewrite && operation.offset_ >= 0
+            && operation.context_->patch_path.lexically_normal() == file) {
+            rewrites[operation.offset_] = &*entry.rewrite;
+        }
+    }
+    size_t rewritten = 0;
+    for (auto it = rewrites.rbegin(); it != rewrites.rend(); ++it) {
+        rewritten += SpliceRewrite(data, it->first, *it->second);
+    }
+
+    std::ofstream out(path, std::ios::binary);
+    out.write(data.data(), data.size());
+    if (!out) {
+        spdlog::error("Failed to write {}", path.string());
+        return false;
+    }
+    spdlog::info("Rewrote {} ops into {}", rewritten, path.string());
+    return true;
+}
@@ -0,0 +1,46 @@
+#include "worker_pool.h"
+
+#include <algorithm>
+
+WorkerPool& WorkerPool::instance()
+{
+    // Never destroyed, joining threads while the game unloads us could dead lock
+    static WorkerPool* instance =
+        new WorkerPool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+    return *instance;
+}
+
+WorkerPool::WorkerPool(size_t threads)
+{
+    for (size_t i = 0; i < threads; ++i) {
+        threads_.emplace_back([this]() { Run(); });
+    }
+}
+
+size_t WorkerPool::Size() const
+{
+    return threads_.size();
+}
+
+void WorkerPool::Submit(std::function<void()> task)
+{
+    {
+        std::scoped_lock lk{mutex_};
+        tasks_.push_back(std::move(task));
+    }
+    wake_.notify_one();
+}
+
+void WorkerPool::Run()
+{
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock lk{mutex_};
+            wake_.wait(lk, [this]() { return !tasks_.empty(); });
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+        task();
+    }
+}
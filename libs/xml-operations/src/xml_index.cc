@@ -0,0 +1,558 @@
+#include "xml_index.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+#include <utility>
+
+namespace
+{
+static bool NameEquals(const char* a, const char* b, bool ignore_case)
+{
+#ifndef _WIN32
+    auto stricmp = [](auto a, auto b) { return strcasecmp(a, b); };
+#endif
+    return ignore_case ? stricmp(a, b) == 0 : strcmp(a, b) == 0;
+}
+
+static pugi::xml_node FindAncestor(pugi::xml_node node, const char* name)
+{
+    if (!node) {
+        return {};
+    }
+    auto parent = node.parent();
+    while (parent && !NameEquals(parent.name(), name, true)) {
+        parent = parent.parent();
+    }
+    return parent;
+}
+
+static std::vector<pugi::xml_node> Containers(const std::vector<pugi::xml_node>& nodes,
+                                              const char*                        name)
+{
+    std::vector<pugi::xml_node> containers;
+    for (auto node : nodes) {
+        auto container = FindAncestor(node, name);
+        if (container
+            && std::find(containers.begin(), containers.end(), container) == containers.end()) {
+            containers.push_back(container);
+        }
+    }
+    return containers;
+}
+
+template <typename F> static void ForEachElement(pugi::xml_node root, F&& f)
+{
+    auto node = root;
+    while (node) {
+        if (node.type() == pugi::xml_node_type::node_element) {
+            f(node);
+        }
+        if (auto child = node.first_child(); child) {
+            node = child;
+            continue;
+        }
+        while (node != root && !node.next_sibling()) {
+            node = node.parent();
+        }
+        if (node == root) {
+            break;
+        }
+        node = node.next_sibling();
+    }
+}
+
+static std::vector<pugi::xml_node> AncestorsOrSelf(pugi::xml_node node)
+{
+    std::vector<pugi::xml_node> chain;
+    for (; node; node = node.parent()) {
+        chain.push_back(node);
+    }
+    std::reverse(chain.begin(), chain.end());
+    return chain;
+}
+
+// Document order for two distinct nodes of the same document
+static bool IsBefore(pugi::xml_node a, pugi::xml_node b)
+{
+    if (a == b) {
+        return false;
+    }
+    const auto chain_a = AncestorsOrSelf(a);
+    const auto chain_b = AncestorsOrSelf(b);
+
+    size_t i = 0;
+    while (i < chain_a.size() && i < chain_b.size() && chain_a[i] == chain_b[i]) {
+        ++i;
+    }
+    if (i == chain_a.size()) {
+        return true; // a is an ancestor of b
+    }
+    if (i == chain_b.size()) {
+        return false; // b is an ancestor of a
+    }
+
+    // Search in both directions at once, inserts usually happen close to existing nodes
+    auto next = chain_a[i];
+    auto prev = chain_a[i];
+    while (next || prev) {
+        if (next && (next = next.next_sibling()) == chain_b[i]) {
+            return true;
+        }
+        if (prev && (prev = prev.previous_sibling()) == chain_b[i]) {
+            return false;
+        }
+    }
+    return false;
+}
+} // namespace
+
+XmlNodeIndex::XmlNodeIndex(std::string element, std::vector<std::string> key_path,
+                           bool ignore_case)
+    : element_(std::move(element))
+    , key_path_(std::move(key_path))
+    , ignore_case_(ignore_case)
+{
+}
+
+bool XmlNodeIndex::IsBuilt() const
+{
+    return built_;
+}
+
+void XmlNodeIndex::Build(pugi::xml_node root)
+{
+    nodes_.clear();
+    ForEachElement(root, [this](pugi::xml_node node) {
+        if (IsIndexed(node)) {
+            if (auto key = Key(node); !key.empty()) {
+                nodes_[key].push_back(node);
+            }
+        }
+    });
+    built_ = true;
+    version_++;
+}
+
+bool XmlNodeIndex::IsIndexed(pugi::xml_node node) const
+{
+    return node.type() == pugi::xml_node_type::node_element
+           && NameEquals(node.name(), element_.c_str(), ignore_case_);
+}
+
+std::string XmlNodeIndex::Key(pugi::xml_node node) const
+{
+    for (const auto& name : key_path_) {
+        node = node.child(name.c_str());
+        if (!node) {
+            return {};
+        }
+    }
+    return node.text().get();
+}
+
+const std::vector<pugi::xml_node>* XmlNodeIndex::Find(const std::string& key) const
+{
+    if (auto it = nodes_.find(key); it != nodes_.end() && !it->second.empty()) {
+        return &it->second;
+    }
+    return nullptr;
+}
+
+void XmlNodeIndex::Add(const std::string& key, pugi::xml_node node)
+{
+    if (key.empty()) {
+        return;
+    }
+    version_++;
+    auto& nodes = nodes_[key];
+    if (nodes.empty() || IsBefore(nodes.back(), node)) {
+        nodes.push_back(node);
+    } else {
+        nodes.insert(std::upper_bound(nodes.begin(), nodes.end(), node, IsBefore), node);
+    }
+}
+
+void XmlNodeIndex::Remove(const std::string& key, pugi::xml_node node)
+{
+    if (auto it = nodes_.find(key); it != nodes_.end()) {
+        version_++;
+        auto& nodes = it->second;
+        nodes.erase(std::remove(nodes.begin(), nodes.end(), node), nodes.end());
+        if (nodes.empty()) {
+            nodes_.erase(it);
+        }
+    }
+}
+
+size_t XmlNodeIndex::Version() const
+{
+    return version_;
+}
+
+void XmlNodeIndex::Insert(pugi::xml_node root)
+{
+    ForEachElement(root, [this](pugi::xml_node node) {
+        if (IsIndexed(node)) {
+            Add(Key(node), node);
+        }
+    });
+}
+
+void XmlNodeIndex::Erase(pugi::xml_node root)
+{
+    ForEachElement(root, [this](pugi::xml_node node) {
+        if (IsIndexed(node)) {
+            Remove(Key(node), node);
+        }
+    });
+}
+
+bool XmlNameIndex::IsBuilt() const
+{
+    return built_;
+}
+
+void XmlNameIndex::Build(pugi::xml_node root)
+{
+    postings_.clear();
+    ForEachElement(root, [this](pugi::xml_node node) {
+        postings_[node.name()].nodes.push_back(node);
+    });
+    built_ = true;
+}
+
+const std::vector<pugi::xml_node>& XmlNameIndex::Find(const std::string& name)
+{
+    static const std::vector<pugi::xml_node> empty;
+
+    auto it = postings_.find(name);
+    if (it == postings_.end()) {
+        return empty;
+    }
+    auto& postings = it->second;
+    if (!postings.sorted) {
+        // pugixml orders nodes by their position in the parsed buffer where it can
+        std::vector<pugi::xpath_node> nodes(postings.nodes.begin(), postings.nodes.end());
+        pugi::xpath_node_set          set(nodes.data(), nodes.data() + nodes.size());
+        set.sort();
+        postings.nodes.clear();
+        for (const auto& node : set) {
+            postings.nodes.push_back(node.node());
+        }
+        postings.sorted = true;
+    }
+    return postings.nodes;
+}
+
+void XmlNameIndex::Insert(pugi::xml_node root)
+{
+    ForEachElement(root, [this](pugi::xml_node node) {
+        auto& postings = postings_[node.name()];
+        postings.nodes.push_back(node);
+        postings.sorted = postings.nodes.size() == 1;
+    });
+}
+
+void XmlNameIndex::Erase(pugi::xml_node root)
+{
+    std::unordered_map<std::string, std::unordered_set<pugi::xml_node_struct*>> removed;
+    ForEachElement(root, [&removed](pugi::xml_node node) {
+        removed[node.name()].insert(node.internal_object());
+    });
+    for (const auto& [name, nodes] : removed) {
+        if (auto it = postings_.find(name); it != postings_.end()) {
+            auto& list = it->second.nodes;
+            list.erase(std::remove_if(list.begin(), list.end(),
+                                      [&nodes = nodes](pugi::xml_node node) {
+                                          return nodes.count(node.internal_object()) > 0;
+                                      }),
+                       list.end());
+            if (list.empty()) {
+                postings_.erase(it);
+            }
+        }
+    }
+}
+
+std::shared_ptr<XmlIndex> XmlIndex::Get(const std::shared_ptr<pugi::xml_document>& doc)
+{
+    struct Attached {
+        std::weak_ptr<pugi::xml_document> doc;
+        std::shared_ptr<XmlIndex>         index;
+    };
+    static std::mutex                                      mutex;
+    static std::unordered_map<pugi::xml_document*, Attached> indexes;
+
+    std::scoped_lock lk{mutex};
+    for (auto it = indexes.begin(); it != indexes.end();) {
+        if (it->second.doc.expired()) {
+            it = indexes.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    auto& attached = indexes[doc.get()];
+    if (!attached.index) {
+        attached.doc   = doc;
+        attached.index = std::make_shared<XmlIndex>(doc.get());
+    }
+    return attached.index;
+}
+
+XmlIndex::XmlIndex(pugi::xml_document* doc)
+    : doc_(doc)
+    , assets_("Asset", {"Values", "Standard", "GUID"}, true)
+    , templates_("Template", {"Name"}, true)
+{
+    for (const auto& definition : SecondaryIndexes()) {
+        secondary_.emplace_back(definition.element, definition.key_path, false);
+    }
+}
+
+const std::vector<XmlIndexDefinition>& XmlIndex::SecondaryIndexes()
+{
+    static const std::vector<XmlIndexDefinition> definitions = {
+        {"Asset", {"Template"}},
+        {"Asset", {"Values", "Standard", "Name"}},
+        {"Asset", {"BaseAssetGUID"}},
+        {"Text", {"GUID"}},
+    };
+    return definitions;
+}
+
+std::vector<pugi::xml_node> XmlIndex::FindByKey(const std::string&              element,
+                                                const std::vector<std::string>& key_path,
+                                                const std::string&              key)
+{
+    const auto& definitions = SecondaryIndexes();
+    for (size_t i = 0; i < definitions.size(); ++i) {
+        if (definitions[i].element == element && definitions[i].key_path == key_path) {
+            auto nodes = Find(secondary_[i], key);
+            return nodes ? *nodes : std::vector<pugi::xml_node>{};
+        }
+    }
+    return {};
+}
+
+const std::vector<pugi::xml_node>* XmlIndex::Find(XmlNodeIndex& index, const std::string& key)
+{
+    if (!index.IsBuilt()) {
+        index.Build(doc_->root());
+    }
+    return index.Find(key);
+}
+
+pugi::xml_node XmlIndex::FindAsset(const std::string& guid)
+{
+    auto nodes = Find(assets_, guid);
+    return nodes ? nodes->front() : pugi::xml_node{};
+}
+
+pugi::xml_node XmlIndex::FindAssetContainer(const std::string& guid)
+{
+    return FindAncestor(FindAsset(guid), "Assets");
+}
+
+pugi::xml_node XmlIndex::FindTemplate(const std::string& name)
+{
+    auto nodes = Find(templates_, name);
+    return nodes ? nodes->front() : pugi::xml_node{};
+}
+
+pugi::xml_node XmlIndex::FindTemplateContainer(const std::string& name)
+{
+    return FindAncestor(FindTemplate(name), "Templates");
+}
+
+std::vector<pugi::xml_node> XmlIndex::FindAssets(const std::string& guid)
+{
+    auto nodes = Find(assets_, guid);
+    return nodes ? *nodes : std::vector<pugi::xml_node>{};
+}
+
+std::vector<pugi::xml_node> XmlIndex::FindAssetContainers(const std::string& guid)
+{
+    return Containers(FindAssets(guid), "Assets");
+}
+
+std::vector<pugi::xml_node> XmlIndex::FindTemplates(const std::string& name)
+{
+    auto nodes = Find(templates_, name);
+    return nodes ? *nodes : std::vector<pugi::xml_node>{};
+}
+
+std::vector<pugi::xml_node> XmlIndex::FindTemplateContainers(const std::string& name)
+{
+    return Containers(FindTemplates(name), "Templates");
+}
+
+std::vector<pugi::xml_node> XmlIndex::FindDerivedAssets(const std::string& guid, bool recursive)
+{
+    static const std::vector<std::string> base_path = {"BaseAssetGUID"};
+
+    std::vector<pugi::xml_node>     derived;
+    std::vector<std::string>        pending = {guid};
+    std::unordered_set<std::string> visited = {guid};
+    while (!pending.empty()) {
+        auto base = std::move(pending.back());
+        pending.pop_back();
+        for (auto asset : FindByKey("Asset", base_path, base)) {
+            derived.push_back(asset);
+            // Broken mods can make an asset its own ancestor
+            if (auto key = assets_.Key(asset);
+                recursive && !key.empty() && visited.insert(key).second) {
+                pending.push_back(std::move(key));
+            }
+        }
+    }
+    return derived;
+}
+
+const std::vector<pugi::xml_node>& XmlIndex::FindByName(const std::string& name)
+{
+    if (!names_.IsBuilt()) {
+        names_.Build(doc_->root());
+    }
+    return names_.Find(name);
+}
+
+size_t XmlIndex::Version() const
+{
+    size_t version = assets_.Version() + templates_.Version();
+    for (const auto& index : secondary_) {
+        version += index.Version();
+    }
+    return version;
+}
+
+bool XmlIndex::IsKnownEmpty(const std::string& path) const
+{
+    return empty_paths_.count(path) > 0;
+}
+
+void XmlIndex::SetKnownEmpty(const std::string& path)
+{
+    empty_paths_.insert(path);
+}
+
+void XmlIndex::TrackTouchedNames(bool enable)
+{
+    track_touched_ = enable;
+    touched_names_.clear();
+}
+
+std::unordered_set<std::string> XmlIndex::TakeTouchedNames()
+{
+    return std::exchange(touched_names_, {});
+}
+
+std::vector<XmlNodeIndex*> XmlIndex::BuiltIndexes()
+{
+    std::vector<XmlNodeIndex*> indexes;
+    for (auto index : {&assets_, &templates_}) {
+        if (index->IsBuilt()) {
+            indexes.push_back(index);
+        }
+    }
+    for (auto& index : secondary_) {
+        if (index.IsBuilt()) {
+            indexes.push_back(&index);
+        }
+    }
+    return indexes;
+}
+
+// Whether the result of path can change when elements with one of names change. Names are only
+// searched for in the text of path, which can't tell e.g. Asset from Assets, but never misses one.
+static bool MayMatch(const std::string& path, const std::unordered_set<std::string>& names)
+{
+    if (path.find('*') != std::string::npos || path.find("node()") != std::string::npos) {
+        return true;
+    }
+    return std::any_of(names.begin(), names.end(), [&path](const std::string& name) {
+        return path.find(name) != std::string::npos;
+    });
+}
+
+XmlIndex::Mutation::Mutation(XmlIndex& index, pugi::xml_node anchor)
+    : index_(index)
+    , indexes_(index.BuiltIndexes())
+    , collect_names_(index.track_touched_ || !index.empty_paths_.empty())
+{
+    Change(anchor);
+}
+
+XmlIndex::Mutation::~Mutation()
+{
+    for (auto& entry : entries_) {
+        auto key = entry.index->Key(entry.node);
+        if (key != entry.key) {
+            entry.index->Remove(entry.key, entry.node);
+            entry.index->Add(key, entry.node);
+        }
+    }
+    if (index_.track_touched_) {
+        index_.touched_names_.insert(names_.begin(), names_.end());
+    }
+    for (auto it = index_.empty_paths_.begin(); it != index_.empty_paths_.end();) {
+        it = MayMatch(*it, names_) ? index_.empty_paths_.erase(it) : std::next(it);
+    }
+}
+
+void XmlIndex::Mutation::Record(pugi::xml_node node)
+{
+    if (collect_names_ && node.type() == pugi::xml_node_type::node_element) {
+        names_.emplace(node.name());
+    }
+    for (auto index : indexes_) {
+        if (index->IsIndexed(node)) {
+            entries_.push_back({index, node, index->Key(node)});
+        }
+    }
+}
+
+void XmlIndex::Mutation::Touch(pugi::xml_node root)
+{
+    if (collect_names_) {
+        ForEachElement(root, [this](pugi::xml_node node) { names_.emplace(node.name()); });
+    }
+}
+
+void XmlIndex::Mutation::Change(pugi::xml_node node)
+{
+    if (indexes_.empty() && !collect_names_) {
+        return;
+    }
+    // Everything above a node recorded before was recorded with it
+    for (; node; node = node.parent()) {
+        if (!recorded_.insert(node.internal_object()).second) {
+            return;
+        }
+        Record(node);
+    }
+}
+
+void XmlIndex::Mutation::Remove(pugi::xml_node node)
+{
+    Touch(node);
+    if (index_.names_.IsBuilt()) {
+        index_.names_.Erase(node);
+    }
+    for (auto index : indexes_) {
+        index->Erase(node);
+    }
+}
+
+void XmlIndex::Mutation::Insert(pugi::xml_node node)
+{
+    Touch(node);
+    if (index_.names_.IsBuilt()) {
+        index_.names_.Insert(node);
+    }
+    for (auto index : indexes_) {
+        index->Insert(node);
+    }
+}
@@ -1,128 +1,410 @@
 #include "xml_operations.h"
+#include "line_table.h"
+#include "op_profiler.h"
+#include "xml_index.h"
+#include "xpath_cache.h"
+#include "xpath_shape.h"
+#include "worker_pool.h"
 
 #include "absl/strings/str_split.h"
 #include "spdlog/spdlog.h"
 
+#include <algorithm>
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
-
-using offset_data_t = std::vector<ptrdiff_t>;
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <set>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
 
 namespace
 {
-static bool build_offset_data(offset_data_t &result, const char *file)
+// Roots of the subtrees a set of ops reads and changes
+class Footprints
 {
-    FILE *f = fopen(file, "rb");
-    if (!f)
+  public:
+    bool Overlaps(const std::vector<pugi::xml_node> &footprint) const
+    {
+        for (auto root : footprint) {
+            if (covered_.count(root.internal_object()) > 0) {
+                return true;
+            }
+            for (auto node = root; node; node = node.parent()) {
+                if (roots_.count(node.internal_object()) > 0) {
+                    return true;
+                }
+            }
+        }
         return false;
+    }
+
+    void Add(const std::vector<pugi::xml_node> &footprint)
+    {
+        for (auto root : footprint) {
+            roots_[root.internal_object()]++;
+            for (auto node = root; node; node = node.parent()) {
+                covered_[node.internal_object()]++;
+            }
+        }
+    }
+
+    void Remove(const std::vector<pugi::xml_node> &footprint)
+    {
+        for (auto root : footprint) {
+            Release(roots_, root.internal_object());
+            for (auto node = root; node; node = node.parent()) {
+                Release(covered_, node.internal_object());
+            }
+        }
+    }
+
+  private:
+    using Counts = std::unordered_map<pugi::xml_node_struct *, size_t>;
+
+    static void Release(Counts &counts, pugi::xml_node_struct *node)
+    {
+        if (auto it = counts.find(node); it != counts.end() && --it->second == 0) {
+            counts.erase(it);
+        }
+    }
+
+    Counts roots_;
+    Counts covered_; // Ancestors-or-self of roots
+};
+
+// Lookup of an upcoming op, run on the worker pool
+using PendingLookup = PendingTask<std::optional<pugi::xpath_node_set>>;
+
+// Sample of the op being applied on this thread while profiling
+thread_local OpProfiler::Sample *profile_sample = nullptr;
+
+// Records the op applied while it is in scope
+class ProfileScope
+{
+  public:
+    explicit ProfileScope(OpProfiler::Sample sample)
+        : sample_(std::move(sample))
+    {
+        sample_.start  = OpProfiler::Clock::now();
+        profile_sample = &sample_;
+    }
 
-    ptrdiff_t offset = 0;
+    ~ProfileScope()
+    {
+        profile_sample = nullptr;
+        OpProfiler::instance().Add(std::move(sample_));
+    }
 
-    char   buffer[1024];
-    size_t size;
+    ProfileScope(const ProfileScope &) = delete;
+    ProfileScope &operator=(const ProfileScope &) = delete;
 
-    while ((size = fread(buffer, 1, sizeof(buffer), f)) > 0) {
-        for (size_t i = 0; i < size; ++i)
-            if (buffer[i] == '\n')
-                result.push_back(offset + i);
+  private:
+    OpProfiler::Sample sample_;
+};
 
-        offset += size;
+// Adds the time it is in scope to a duration of the current sample
+class ProfileTimer
+{
+  public:
+    explicit ProfileTimer(OpProfiler::Clock::duration OpProfiler::Sample::*duration)
+        : duration_(profile_sample ? duration : nullptr)
+    {
+        if (duration_) {
+            start_ = OpProfiler::Clock::now();
+        }
     }
 
-    fclose(f);
+    ~ProfileTimer()
+    {
+        if (duration_ && profile_sample) {
+            profile_sample->*duration_ += OpProfiler::Clock::now() - start_;
+        }
+    }
+
+  private:
+    OpProfiler::Clock::duration OpProfiler::Sample::*duration_;
+    OpProfiler::Clock::time_point                    start_;
+};
+
+static void ProfileLookup(const char *lookup, bool prefetched = false)
+{
+    if (profile_sample) {
+        profile_sample->lookup     = lookup;
+        profile_sample->prefetched = prefetched;
+    }
+}
 
-    return true;
+static const char *TypeName(XmlOperation::Type type)
+{
+    switch (type) {
+        case XmlOperation::Type::Add:
+            return "add";
+        case XmlOperation::Type::AddNextSibling:
+            return "addNextSibling";
+        case XmlOperation::Type::AddPrevSibling:
+            return "addPrevSibling";
+        case XmlOperation::Type::Remove:
+            return "remove";
+        case XmlOperation::Type::Replace:
+            return "replace";
+        case XmlOperation::Type::Merge:
+            return "merge";
+        case XmlOperation::Type::Table:
+            return "table";
+        default:
+            return "none";
+    }
 }
 
-static std::pair<size_t, size_t> get_location(const offset_data_t &data, ptrdiff_t offset)
+// Problems with ops, collected while the ops of a patch file are read or applied and logged in
+// one go afterwards. Lines are only looked up then, from the LineTable of the file.
+class Diagnostics
 {
-    offset_data_t::const_iterator it    = std::lower_bound(data.begin(), data.end(), offset);
-    size_t                        index = it - data.begin();
+  public:
+    enum Kind {
+        NO_MATCHING_NODE,
+        NO_MATCHING_ROW, // Of a table file, detail is the file
+        UNKNOWN_TYPE,    // detail is the type
+    };
+
+    void Add(Kind kind, const XmlOperation::Context &context, ptrdiff_t offset, std::string path,
+             std::string detail, size_t line)
+    {
+        entries_.push_back({kind, &context, offset, std::move(path), std::move(detail), line});
+    }
 
-    return std::make_pair(1 + index, index == 0 ? offset + 1 : offset - data[index - 1]);
+    void Flush()
+    {
+        LineLookup lines;
+        for (const auto &entry : entries_) {
+            const auto &context = *entry.context;
+            const auto  line =
+                entry.line > 0 ? entry.line : lines.Line(context.patch_path, entry.offset);
+            switch (entry.kind) {
+                case NO_MATCHING_NODE:
+                    spdlog::warn("[{}] No matching node for Path {} ({}:{})", context.mod_name,
+                                 entry.path, context.game_path.string(), line);
+                    break;
+                case NO_MATCHING_ROW:
+                    spdlog::warn("[{}] No matching node for Path {} ({}:{})", context.mod_name,
+                                 entry.path, entry.detail, line);
+                    break;
+                case UNKNOWN_TYPE:
+                    spdlog::error("[{}] Unknown ModOp({}), ignoring {} ({}:{})", context.mod_name,
+                                  entry.detail, entry.path, context.game_path.string(), line);
+                    break;
+            }
+        }
+        entries_.clear();
+    }
+
+  private:
+    struct Entry {
+        Kind                         kind;
+        const XmlOperation::Context *context;
+        ptrdiff_t                    offset;
+        std::string                  path;
+        std::string                  detail;
+        size_t                       line; // Used instead of offset if not 0
+    };
+
+    std::vector<Entry> entries_;
+};
+
+// Collector of the ops being read or applied on this thread, nothing is collected if null
+thread_local Diagnostics *current_diagnostics = nullptr;
+
+// Collects the diagnostics of everything done while it is in scope and logs them at the end
+class DiagnosticsScope
+{
+  public:
+    DiagnosticsScope()
+        : previous_(current_diagnostics)
+    {
+        current_diagnostics = &diagnostics_;
+    }
+
+    ~DiagnosticsScope()
+    {
+        current_diagnostics = previous_;
+        try {
+            diagnostics_.Flush();
+        } catch (const std::exception &e) {
+            spdlog::error("Failed to log op diagnostics: {}", e.what());
+        }
+    }
+
+    DiagnosticsScope(const DiagnosticsScope &) = delete;
+    DiagnosticsScope &operator=(const DiagnosticsScope &) = delete;
+
+  private:
+    Diagnostics  diagnostics_;
+    Diagnostics *previous_;
+};
+
+static void Report(Diagnostics::Kind kind, const XmlOperation::Context &context, ptrdiff_t offset,
+                   std::string path, std::string detail = "", size_t line = 0)
+{
+    if (current_diagnostics) {
+        current_diagnostics->Add(kind, context, offset, std::move(path), std::move(detail), line);
+        return;
+    }
+    Diagnostics diagnostics;
+    diagnostics.Add(kind, context, offset, std::move(path), std::move(detail), line);
+    diagnostics.Flush();
 }
+
+// Whether the relative path can select the node it is evaluated on
+static bool MaySelectContext(std::string_view path)
+{
+    return path == "." || path.substr(0, 6) == "self::"
+           || path.substr(0, 20) == "descendant-or-self::" || path.substr(0, 1) == "("
+           || path.find('|') != std::string_view::npos;
+}
+
+static std::shared_ptr<pugi::xml_document> LoadPatchDocument(const fs::path    &path,
+                                                             const std::string &mod_name)
+{
+    auto doc          = std::make_shared<pugi::xml_document>();
+    auto parse_result = doc->load_file(path.string().c_str());
+    if (!parse_result) {
+        auto location = LineTable::ForFile(path)->Location(parse_result.offset);
+        spdlog::error("[{}] Failed to parse {}({}, {}): {}", mod_name, path.string(),
+                      location.first, location.second, parse_result.description());
+        return nullptr;
+    }
+    return doc;
+}
+
+// Documents pulled in by <Include>. A file included by several patches is parsed once, by the
+// first one to ask for it, the others wait for that. Entries are dropped when the file changes.
+class IncludeCache
+{
+  public:
+    static IncludeCache &instance()
+    {
+        static IncludeCache instance;
+        return instance;
+    }
+
+    std::shared_ptr<pugi::xml_document> Load(const fs::path &path, const std::string &mod_name)
+    {
+        std::error_code ec;
+        const auto      write_time = fs::last_write_time(path, ec);
+        const auto      key        = path.lexically_normal().generic_string();
+
+        std::promise<std::shared_ptr<pugi::xml_document>>       promise;
+        std::shared_future<std::shared_ptr<pugi::xml_document>> loading;
+        {
+            std::scoped_lock lk{mutex_};
+            auto             it = entries_.find(key);
+            if (it != entries_.end() && it->second.write_time == write_time) {
+                loading = it->second.doc;
+            } else {
+                entries_[key] = {write_time, promise.get_future().share()};
+            }
+        }
+        if (loading.valid()) {
+            return loading.get();
+        }
+
+        auto doc = LoadPatchDocument(path, mod_name);
+        promise.set_value(doc);
+        return doc;
+    }
+
+    void Clear()
+    {
+        std::scoped_lock lk{mutex_};
+        entries_.clear();
+    }
+
+  private:
+    struct Entry {
+        fs::file_time_type                                      write_time;
+        std::shared_future<std::shared_ptr<pugi::xml_document>> doc;
+    };
+
+    std::mutex                             mutex_;
+    std::unordered_map<std::string, Entry> entries_;
+};
+
+// Includes being expanded on this thread, to stop files from including themselves
+thread_local std::vector<std::string> include_chain;
 } // namespace
 
-XmlOperation::XmlOperation(std::shared_ptr<pugi::xml_document> doc, pugi::xml_node node,
-                           std::string guid, std::string temp, std::string mod_name,
-                           fs::path game_path, fs::path mod_path)
+// Ops are moved around in vectors a lot, that must not copy their strings
+static_assert(std::is_nothrow_move_constructible_v<XmlOperation>);
+
+XmlOperation::XmlOperation(std::shared_ptr<const Context> context, pugi::xml_node node,
+                           std::string guid, std::string temp, ptrdiff_t offset)
 {
-    guid_     = guid;
-    template_ = temp;
+    if (!guid.empty()) {
+        guids_ = absl::StrSplit(guid, ',');
+    }
+    template_ = std::move(temp);
+    context_  = std::move(context);
     node_     = node;
-    doc_      = doc;
+    offset_   = offset >= 0 ? offset : node.offset_debug();
 
-    mod_name_  = mod_name;
-    game_path_ = game_path;
-    mod_path_  = mod_path;
+    base_guid_ = GetXmlPropString(node, "BaseGUID");
+    recursive_ = node.attribute("Recursive").as_bool();
+    merge_key_ = GetXmlPropString(node, "MergeKey");
 
-    ReadPath(node, guid, temp);
-    ReadType(node, mod_name, game_path, mod_path);
-    if (type_ != Type::Remove) {
+    ReadPath(node, template_);
+    ReadType(node);
+    if (type_ == Type::Table) {
+        ReadTable(node);
+    }
+    if (!merge_key_.empty() && type_ != Type::Merge) {
+        spdlog::warn("[{}] `MergeKey` only applies to merge, ignoring it for {}",
+                     context_->mod_name, GetPath());
+        merge_key_.clear();
+    }
+    if (type_ != Type::Remove && type_ != Type::Table) {
         nodes_ = node.children();
     }
 
     skip_ = node.attribute("Skip");
 }
 
-void XmlOperation::ReadPath(pugi::xml_node node, std::string guid, std::string temp)
+void XmlOperation::ReadPath(pugi::xml_node node, std::string temp)
 {
     auto prop_path = GetXmlPropString(node, "Path");
     if (prop_path.empty()) {
         prop_path = "/";
     }
 
-    if (guid.empty()) {
-        // Rewrite path to use faster GUID lookup
-        int g;
-        // Matches stuff like this and extracts GUID //Assets[Asset/Values/Standard/GUID='102119']
-        if (sscanf(prop_path.c_str(), "//Assets[Asset/Values/Standard/GUID='%d']", &g) > 0) {
-            if (std::string("//Assets[Asset/Values/Standard/GUID='") + std::to_string(g) + "']"
-                == prop_path) {
-                guid                   = std::to_string(g);
-                guid_                  = std::to_string(g);
-                speculative_path_type_ = SpeculativePathType::ASSET_CONTAINER;
-            }
-        }
-    } else {
-        speculative_path_type_ = SpeculativePathType::SINGLE_ASSET;
-        path_                  = "//Asset[Values/Standard/GUID='" + guid + "']";
-    }
-
-    if (temp.empty()) {
-        char g[256];
-        if (sscanf(prop_path.c_str(), "//Template[Name='%s']", g) > 0) {
-            if (std::string("//Template[Name='" + std::string(g) + "']") == prop_path) {
-                temp                   = g;
-                template_              = g;
-                speculative_path_type_ = SpeculativePathType::TEMPLATE_CONTAINER;
-            }
-        }
-    } else {
-        speculative_path_type_ = SpeculativePathType::SINGLE_TEMPLATE;
-        path_                  = "//Template[Name='" + temp + "']";
-    }
-
     if (prop_path.find("/") != 0) {
-        path_ += "/";
+        path_suffix_ += "/";
     }
-    path_ += prop_path;
-    if (path_ == "/") {
-        path_ = "/*";
+    path_suffix_ += prop_path;
+    if (path_suffix_[path_suffix_.length() - 1] == '/') {
+        path_suffix_ = path_suffix_.substr(0, path_suffix_.length() - 1);
     }
-    if (path_.length() > 0) {
-        if (path_[path_.length() - 1] == '/') {
-            path_ = path_.substr(0, path_.length() - 1);
-        }
+
+    if (!guids_.empty()) {
+        speculative_path_type_ = SpeculativePathType::SINGLE_ASSET;
+        path_                  = GetPath(guids_.front());
+    } else if (!temp.empty()) {
+        speculative_path_type_ = SpeculativePathType::SINGLE_TEMPLATE;
+        path_                  = "//Template[Name='" + temp + "']" + path_suffix_;
+    } else if (!base_guid_.empty()) {
+        speculative_path_type_ = SpeculativePathType::DERIVED_ASSETS;
+        // Only used for logging when recursive, there is no XPath equivalent
+        path_ = "//Asset[BaseAssetGUID='" + base_guid_ + "']" + path_suffix_;
+    } else {
+        path_ = path_suffix_.empty() ? "/*" : path_suffix_;
     }
 
-    if (!guid.empty() || !temp.empty()) {
-        if (speculative_path_type_ == SpeculativePathType::ASSET_CONTAINER
-            || speculative_path_type_ == SpeculativePathType::TEMPLATE_CONTAINER) {
-            speculative_path_ = "/";
-        } else {
-            speculative_path_ += prop_path;
-        }
+    if (!guids_.empty() || !temp.empty() || !base_guid_.empty()) {
+        speculative_path_ += prop_path;
 
         if (speculative_path_ == "/") {
             speculative_path_ = "self::node()";
@@ -134,14 +416,58 @@ void XmlOperation::ReadPath(pugi::xml_node node, std::string guid, std::string t
             }
         }
 
-        if (speculative_path_.find("/") == 0) {
+        if (speculative_path_.find("//") == 0) {
+            speculative_path_ = "." + speculative_path_;
+        } else if (speculative_path_.find("/") == 0) {
             speculative_path_ = speculative_path_.substr(1);
         }
+
+        // If the full path is well-formed the asset is the only place it can match
+        authoritative_ = XPathShape::Parse(path_).has_value() || recursive_;
+        return;
+    }
+
+    // Rewrite path to use faster GUID, template or other indexed lookup
+    // Matches stuff like //Asset[Values/Standard/GUID='102119']/Values/Standard/Name,
+    // /Templates/Group[Name='Objects']/Template[Name='Residence7']/Properties
+    // or //Asset[Template='Residence7']/Values
+    auto shape = XPathShape::Parse(path_);
+    if (!shape) {
+        return;
     }
+    auto anchor = shape->FindAnchor();
+    if (!anchor) {
+        return;
+    }
+    switch (anchor->kind) {
+        case XPathAnchor::ASSET:
+            speculative_path_type_ = SpeculativePathType::SINGLE_ASSET;
+            guids_                 = {anchor->key};
+            break;
+        case XPathAnchor::ASSET_CONTAINER:
+            speculative_path_type_ = SpeculativePathType::ASSET_CONTAINER;
+            guids_                 = {anchor->key};
+            break;
+        case XPathAnchor::TEMPLATE:
+            speculative_path_type_ = SpeculativePathType::SINGLE_TEMPLATE;
+            template_              = anchor->key;
+            break;
+        case XPathAnchor::TEMPLATE_CONTAINER:
+            speculative_path_type_ = SpeculativePathType::TEMPLATE_CONTAINER;
+            template_              = anchor->key;
+            break;
+        case XPathAnchor::KEYED:
+            speculative_path_type_ = SpeculativePathType::KEYED;
+            break;
+    }
+    speculative_path_ = anchor->relative_path;
+    anchor_step_      = anchor->step;
+    anchor_           = std::move(anchor);
+    shape_            = std::move(shape);
+    authoritative_    = true;
 }
 
-void XmlOperation::ReadType(pugi::xml_node node, std::string mod_name, fs::path game_path,
-                            fs::path mod_path)
+void XmlOperation::ReadType(pugi::xml_node node)
 {
 #ifndef _WIN32
     auto stricmp = [](auto a, auto b) { return strcasecmp(a, b); };
@@ -161,248 +487,716 @@ void XmlOperation::ReadType(pugi::xml_node node, std::string mod_name, fs::path
         type_ = Type::Replace;
     } else if (stricmp(type.c_str(), "merge") == 0) {
         type_ = Type::Merge;
+    } else if (stricmp(type.c_str(), "table") == 0) {
+        type_ = Type::Table;
     } else {
         type_ = Type::None;
-        offset_data_t offset_data;
-        build_offset_data(offset_data, mod_path.string().c_str());
-        auto [line, column] = get_location(offset_data, node_.offset_debug());
-        spdlog::warn("No matching node for Path {} in {} ({}:{})", GetPath(), mod_name,
-                     game_path.string(), line);
-        spdlog::error("Unknown ModOp({}), ignoring {}", type, GetPath());
+        Report(Diagnostics::UNKNOWN_TYPE, *context_, offset_, GetPath(), type);
     }
 }
 
-std::optional<pugi::xml_node> XmlOperation::FindAsset(std::string guid, pugi::xml_node node)
+void XmlOperation::ReadTable(pugi::xml_node node)
 {
-#ifndef _WIN32
-    auto stricmp = [](auto a, auto b) { return strcasecmp(a, b); };
-#endif
-    //
-    if (stricmp(node.name(), "Asset") == 0) {
-        auto values = node.child("Values");
-        if (!values) {
-            return {};
+    for (auto row : node.children("Row")) {
+        AddTableRow(GetXmlPropString(row, "GUID"), GetXmlPropString(row, "Path"),
+                    row.text().as_string(), 0);
+    }
+
+    table_file_ = GetXmlPropString(node, "File");
+    if (table_file_.empty()) {
+        return;
+    }
+    // One row per line: GUID,Path,Value. The value is the rest of the line and may contain ','
+    const auto    path = TableFilePath();
+    std::ifstream file(path);
+    if (!file) {
+        spdlog::error("[{}] Failed to open table {}", context_->mod_name, path.string());
+        return;
+    }
+    std::string line;
+    for (size_t number = 1; std::getline(file, line); ++number) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty() || line.front() == '#') {
+            continue;
+        }
+        std::vector<std::string> fields = absl::StrSplit(line, absl::MaxSplits(',', 2));
+        if (fields.size() < 3) {
+            spdlog::warn("[{}] Expected GUID,Path,Value in {}:{}", context_->mod_name,
+                         path.string(), number);
+            continue;
         }
+        if (number == 1 && fields[0] == "GUID") {
+            continue; // Header
+        }
+        AddTableRow(std::move(fields[0]), fields[1], std::move(fields[2]), number);
+    }
+}
 
-        auto standard = values.child("Standard");
-        if (!standard) {
-            return {};
+fs::path XmlOperation::TableFilePath() const
+{
+    // The loader passes the patch itself as mod_path, only ops that weren't read from a file
+    // resolve the table against it
+    if (context_->patch_path.empty()) {
+        return context_->mod_path / table_file_;
+    }
+    return context_->patch_path.parent_path() / table_file_;
+}
+
+void XmlOperation::AddTableRow(std::string guid, std::string_view path, std::string value,
+                               size_t line)
+{
+    TableRow row{std::move(guid), "", "", std::move(value), line};
+    // Values/Building/@Cost sets the attribute Cost of Values/Building
+    const auto slash = path.rfind('/');
+    const auto last  = slash == std::string_view::npos ? path : path.substr(slash + 1);
+    if (!last.empty() && last.front() == '@') {
+        row.attribute = last.substr(1);
+        path.remove_suffix(last.size());
+    }
+    while (!path.empty() && path.front() == '/') {
+        path.remove_prefix(1);
+    }
+    while (!path.empty() && path.back() == '/') {
+        path.remove_suffix(1);
+    }
+    row.path = path;
+    rows_.push_back(std::move(row));
+}
+
+void XmlOperation::ApplyTable(std::shared_ptr<pugi::xml_document> doc)
+{
+    ProfileTimer timer(&OpProfiler::Sample::apply_time);
+    ProfileLookup("table rows");
+    auto   index   = XmlIndex::Get(doc);
+    size_t applied = 0;
+    for (const auto &row : rows_) {
+        // GUID ops stick to the first asset with the GUID, so do rows
+        const auto     assets = index->FindAssets(row.guid);
+        pugi::xml_node node;
+        if (!assets.empty()) {
+            node = assets.front().first_element_by_path(row.path.c_str());
+        }
+        if (!node) {
+            auto row_path = "//Asset[Values/Standard/GUID='" + row.guid + "']/" + row.path;
+            if (row.line > 0) {
+                Report(Diagnostics::NO_MATCHING_ROW, *context_, offset_, std::move(row_path),
+                       table_file_, row.line);
+            } else {
+                Report(Diagnostics::NO_MATCHING_NODE, *context_, offset_, std::move(row_path));
+            }
+            continue;
         }
 
-        auto GUID = standard.child("GUID");
-        if (!GUID) {
-            return {};
+        XmlIndex::Mutation mutation(*index, node);
+        if (row.attribute.empty()) {
+            node.text().set(row.value.c_str());
+        } else {
+            auto attribute = node.attribute(row.attribute.c_str());
+            if (!attribute) {
+                attribute = node.append_attribute(row.attribute.c_str());
+            }
+            attribute.set_value(row.value.c_str());
         }
+        applied++;
+    }
+    spdlog::debug("Set {} of {} table rows", applied, rows_.size());
+    if (profile_sample) {
+        profile_sample->matches += applied;
+    }
+}
 
-        if (GUID.text().get() != guid) {
+std::vector<pugi::xml_node> XmlOperation::FindTargets(XmlIndex &index, const std::string &guid)
+{
+    switch (speculative_path_type_) {
+        case SpeculativePathType::SINGLE_ASSET:
+            return index.FindAssets(guid);
+        case SpeculativePathType::ASSET_CONTAINER:
+            return index.FindAssetContainers(guid);
+        case SpeculativePathType::SINGLE_TEMPLATE:
+            return index.FindTemplates(template_);
+        case SpeculativePathType::TEMPLATE_CONTAINER:
+            return index.FindTemplateContainers(template_);
+        case SpeculativePathType::KEYED:
+            return index.FindByKey(anchor_->element, anchor_->key_path, anchor_->key);
+        case SpeculativePathType::DERIVED_ASSETS:
+            return index.FindDerivedAssets(base_guid_, recursive_);
+        default:
             return {};
+    }
+}
+
+const char *XmlOperation::SpeculativeLookupName() const
+{
+    switch (speculative_path_type_) {
+        case SpeculativePathType::SINGLE_ASSET:
+            return "guid index";
+        case SpeculativePathType::ASSET_CONTAINER:
+            return "guid index (container)";
+        case SpeculativePathType::SINGLE_TEMPLATE:
+            return "template index";
+        case SpeculativePathType::TEMPLATE_CONTAINER:
+            return "template index (container)";
+        case SpeculativePathType::KEYED:
+            return "key index";
+        case SpeculativePathType::DERIVED_ASSETS:
+            return "base guid index";
+        default:
+            return "full path";
+    }
+}
+
+std::string XmlOperation::TargetKey() const
+{
+    if (skip_ || type_ == Type::None || type_ == Type::Table || guids_.size() > 1) {
+        return {};
+    }
+    std::string key;
+    switch (speculative_path_type_) {
+        case SpeculativePathType::SINGLE_ASSET:
+        case SpeculativePathType::ASSET_CONTAINER:
+            key = guids_.front();
+            break;
+        case SpeculativePathType::SINGLE_TEMPLATE:
+        case SpeculativePathType::TEMPLATE_CONTAINER:
+            key = template_;
+            break;
+        case SpeculativePathType::KEYED:
+            key = anchor_->element;
+            for (const auto &name : anchor_->key_path) {
+                key += "/" + name;
+            }
+            key += "=" + anchor_->key;
+            break;
+        case SpeculativePathType::DERIVED_ASSETS:
+            key = base_guid_ + (recursive_ ? "*" : "");
+            break;
+        default:
+            return {};
+    }
+    return std::to_string(speculative_path_type_) + ":" + key;
+}
+
+std::optional<pugi::xpath_node_set>
+XmlOperation::ReadSpeculativeNodes(std::shared_ptr<pugi::xml_document> doc, const std::string &guid,
+                                   const std::vector<pugi::xml_node> *targets)
+{
+    if (speculative_path_type_ == SpeculativePathType::NONE) {
+        spdlog::debug("Not doing speculative path lookup :(");
+        return {};
+    }
+
+    auto candidates = targets ? *targets : FindTargets(*XmlIndex::Get(doc), guid);
+
+    try {
+        if (shape_) {
+            candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                                            [this](pugi::xml_node candidate) {
+                                                return !shape_->Matches(anchor_step_, candidate);
+                                            }),
+                             candidates.end());
+        }
+        if (candidates.empty()) {
+            spdlog::debug("Speculative path failed to find node {}", GetPath(guid));
         }
-        if (speculative_path_type_ == SpeculativePathType::ASSET_CONTAINER) {
-            auto parent = node.parent();
-            while (parent && stricmp(parent.name(), "Assets") != 0) {
-                parent = parent.parent();
+
+        std::vector<pugi::xpath_node> nodes;
+        if (speculative_path_ != "*") {
+            auto query = XPathCache::instance().Get(speculative_path_);
+            for (size_t i = 0; i < candidates.size(); ++i) {
+                auto selected = candidates[i].select_nodes(*query);
+                nodes.insert(nodes.end(), selected.begin(), selected.end());
+                // GUID and Template ops stick to the first match unless it has no such path
+                if (i == 0 && !shape_ && base_guid_.empty() && !nodes.empty()) {
+                    break;
+                }
             }
-            if (stricmp(parent.name(), "Assets") == 0) {
-                return parent;
+        }
+        if (nodes.empty()) {
+            spdlog::debug("Speculative path failed to find node with path {} {}", GetPath(guid),
+                          speculative_path_);
+            if (!authoritative_) {
+                return {};
             }
-            return {};
-        } else {
-            return node;
         }
-    }
 
-    for (pugi::xml_node n : node.children()) {
-        if (auto found = FindAsset(guid, n); found) {
-            return found;
+        if (candidates.size() > 1) {
+            // Paths leaving the anchor (e.g. through ..) can reach the same node twice
+            std::set<std::pair<void *, void *>> seen;
+            nodes.erase(std::remove_if(nodes.begin(), nodes.end(),
+                                       [&seen](const pugi::xpath_node &node) {
+                                           return !seen
+                                                       .emplace(node.node().internal_object(),
+                                                                node.attribute().internal_object())
+                                                       .second;
+                                       }),
+                        nodes.end());
         }
+        pugi::xpath_node_set results(nodes.data(), nodes.data() + nodes.size());
+        if (candidates.size() > 1) {
+            results.sort();
+        }
+        return results;
+    } catch (const pugi::xpath_exception &e) {
+        spdlog::warn("Speculative path lookup failed {} (GUID={}, Template={}) in {}: {}. Please "
+                     "create an issue with the mod op that caused this! Falling back to regular "
+                     "'slow' lookup.",
+                     speculative_path_, guid, template_, context_->patch_path.string(), e.what());
     }
-
     return {};
 }
 
-std::optional<pugi::xml_node> XmlOperation::FindAsset(std::shared_ptr<pugi::xml_document> doc,
-                                                      std::string                         guid)
+void XmlOperation::Apply(std::shared_ptr<pugi::xml_document> doc)
 {
-    return FindAsset(guid, doc->root());
+    if (skip_ || GetType() == XmlOperation::Type::None) {
+        return;
+    }
+    if (type_ == Type::Table) {
+        ApplyTable(doc);
+        return;
+    }
+    if (guids_.empty()) {
+        Apply(doc, "");
+        return;
+    }
+    // The content is brought into doc once for all GUIDs, each of their targets gets a copy
+    if (guids_.size() > 1 && type_ != Type::Merge && type_ != Type::Remove) {
+        staging_ = ImportContent(*doc);
+    }
+    // Targets are resolved one after another, an earlier GUID might add or remove a later one
+    for (const auto &guid : guids_) {
+        Apply(doc, guid);
+    }
+    if (staging_) {
+        doc->remove_child(staging_);
+        staging_ = {};
+    }
 }
 
-std::optional<pugi::xml_node> XmlOperation::FindTemplate(std::string temp, pugi::xml_node node)
+void XmlOperation::ApplyOperations(std::vector<XmlOperation>          &operations,
+                                   std::shared_ptr<pugi::xml_document> doc)
 {
-#ifndef _WIN32
-    auto stricmp = [](auto a, auto b) { return strcasecmp(a, b); };
-#endif
-    //
-    if (stricmp(node.name(), "Template") == 0) {
-        auto template_name = node.child("Name");
-        if (!template_name) {
-            return {};
+    auto             index = XmlIndex::Get(doc);
+    DiagnosticsScope diagnostics;
+
+    // Consecutive ops on the same asset or template share its lookup until an index changes
+    struct Targets {
+        std::string                 key;
+        size_t                      version = 0;
+        std::vector<pugi::xml_node> nodes;
+    } targets;
+    size_t     saved_lookups = 0;
+    const auto find_targets  = [&](XmlOperation &operation, std::string key) {
+        if (key == targets.key && index->Version() == targets.version) {
+            saved_lookups++;
+        } else {
+            targets.nodes   = operation.FindTargets(*index, operation.FirstGuid());
+            targets.key     = std::move(key);
+            targets.version = index->Version();
         }
+        return targets.nodes;
+    };
 
-        if (template_name.text().get() != temp) {
-            return {};
+    XPathBatch          batch;
+    std::vector<size_t> ids;
+    ids.reserve(operations.size());
+    for (auto &operation : operations) {
+        ids.push_back(operation.IsBatchable() ? batch.Add(operation.GetPath()) : XPathBatch::npos);
+    }
+
+    // Lookups for the ops coming up run on the worker pool while earlier ops are applied. Only
+    // ops with footprints disjoint from every op ahead of them qualify, nothing they read can be
+    // changed in between then. The mutations stay on this thread and in order.
+    struct Prefetch {
+        size_t                          operation;
+        std::vector<pugi::xml_node>     targets;
+        std::vector<pugi::xml_node>     footprint;
+        size_t                          version;
+        std::shared_ptr<PendingLookup> lookup;
+    };
+    constexpr size_t     WINDOW_SIZE = 64;
+    std::deque<Prefetch> window;
+    Footprints           footprints;
+    size_t               next       = 0;
+    size_t               prefetched = 0;
+
+    index->TrackTouchedNames(true);
+    for (size_t i = 0; i < operations.size(); ++i) {
+        for (next = std::max(next, i); next < operations.size() && window.size() < WINDOW_SIZE;
+             ++next) {
+            auto &operation = operations[next];
+            auto  key       = operation.TargetKey();
+            if (ids[next] != XPathBatch::npos || key.empty()) {
+                break;
+            }
+            auto op_targets = find_targets(operation, std::move(key));
+            auto footprint  = operation.Footprint(op_targets);
+            if (!footprint || footprints.Overlaps(*footprint)) {
+                break;
+            }
+            footprints.Add(*footprint);
+
+            auto lookup = std::make_shared<PendingLookup>();
+            window.push_back({next, std::move(op_targets), std::move(*footprint),
+                              index->Version(), lookup});
+            lookup->task = [&operation, &doc, targets = &window.back().targets]() {
+                return operation.ReadSpeculativeNodes(doc, operation.FirstGuid(), targets);
+            };
+            if (WorkerPool::instance().Size() > 0) {
+                WorkerPool::instance().Submit([lookup]() { lookup->Run(); });
+            }
         }
 
-        if (speculative_path_type_ == SpeculativePathType::TEMPLATE_CONTAINER) {
-            auto parent = node.parent();
-            while (parent && stricmp(parent.name(), "Templates") != 0) {
-                parent = parent.parent();
+        auto &operation = operations[i];
+
+        std::optional<ProfileScope> profile;
+        if (OpProfiler::instance().Enabled()) {
+            OpProfiler::Sample sample;
+            sample.mod_name   = operation.context_->mod_name;
+            sample.patch_path = operation.context_->patch_path;
+            sample.offset     = operation.offset_;
+            sample.path       = operation.GetPath();
+            sample.type       = TypeName(operation.type_);
+            profile.emplace(std::move(sample));
+        }
+
+        if (!window.empty() && window.front().operation == i) {
+            // The lookup refers to the targets in the window, it has to be done before moving them
+            std::optional<pugi::xpath_node_set> results;
+            try {
+                ProfileTimer timer(&OpProfiler::Sample::lookup_time);
+                results = window.front().lookup->Get();
+            } catch (const std::exception &e) {
+                // Looked up again below, on this thread
+                spdlog::warn("Prefetched lookup of {} in {} failed: {}", operation.GetPath(),
+                             operation.context_->patch_path.string(), e.what());
             }
-            if (stricmp(parent.name(), "Templates") == 0) {
-                return parent;
+            auto prefetch = std::move(window.front());
+            window.pop_front();
+            footprints.Remove(prefetch.footprint);
+
+            if (index->Version() != prefetch.version) {
+                // An op in between added, removed or re-keyed indexed nodes
+                operation.Apply(doc);
+            } else if (results) {
+                prefetched++;
+                ProfileLookup(operation.SpeculativeLookupName(), true);
+                operation.Apply(doc, operation.FirstGuid(), *results);
+            } else {
+                operation.Apply(doc, operation.FirstGuid(), &prefetch.targets);
             }
-            return {};
+        } else if (auto key = operation.TargetKey(); ids[i] == XPathBatch::npos && !key.empty()) {
+            std::vector<pugi::xml_node> op_targets;
+            {
+                ProfileTimer timer(&OpProfiler::Sample::lookup_time);
+                op_targets = find_targets(operation, std::move(key));
+            }
+            operation.Apply(doc, operation.FirstGuid(), &op_targets);
+        } else if (ids[i] == XPathBatch::npos) {
+            operation.Apply(doc);
         } else {
-            return node;
+            try {
+                spdlog::debug("Looking up {}", operation.GetPath());
+                pugi::xpath_node_set results;
+                {
+                    ProfileTimer timer(&OpProfiler::Sample::lookup_time);
+                    results = batch.Select(*index, ids[i]);
+                }
+                ProfileLookup("name index");
+                operation.Apply(doc, "", results);
+            } catch (const pugi::xpath_exception &e) {
+                spdlog::error("Failed to parse path {} in {}: {}", operation.GetPath(),
+                              operation.context_->patch_path.string(), e.what());
+            }
+            batch.Release(ids[i]);
         }
+        batch.Invalidate(index->TakeTouchedNames());
     }
+    index->TrackTouchedNames(false);
 
-    for (pugi::xml_node n : node.children()) {
-        if (auto found = FindTemplate(temp, n); found) {
-            return found;
+    if (saved_lookups > 0) {
+        spdlog::debug("Reused the targets of the previous op {} times", saved_lookups);
+    }
+    if (prefetched > 0) {
+        spdlog::debug("Used {} lookups done ahead of time", prefetched);
+    }
+    const auto batched = operations.size() - std::count(ids.begin(), ids.end(), XPathBatch::npos);
+    if (batched > 0) {
+        spdlog::debug("Looked up {} ops with {} passes over the name index", batched,
+                      batch.Passes());
+    }
+}
+
+std::optional<std::vector<pugi::xml_node>>
+XmlOperation::Footprint(const std::vector<pugi::xml_node> &targets) const
+{
+    if (!authoritative_ || !XPathShape::IsLocal(speculative_path_)) {
+        return {};
+    }
+    // Everything but Add changes the parent of the selected node, Merge may even go on with its
+    // siblings
+    if (type_ != Type::Add && MaySelectContext(speculative_path_)) {
+        return {};
+    }
+    if (shape_) {
+        // Steps above the anchor are checked on its ancestors, which other ops can change
+        for (size_t i = 0; i <= anchor_step_; ++i) {
+            for (const auto &predicate : shape_->Steps()[i].predicates) {
+                if (i < anchor_step_ || !XPathShape::IsLocal(predicate)) {
+                    return {};
+                }
+            }
         }
     }
+    return targets;
+}
 
-    return {};
+const std::string &XmlOperation::FirstGuid() const
+{
+    static const std::string none;
+    return guids_.empty() ? none : guids_.front();
 }
 
-std::optional<pugi::xml_node> XmlOperation::FindTemplate(std::shared_ptr<pugi::xml_document> doc,
-                                                         std::string                         temp)
+bool XmlOperation::IsBatchable() const
 {
-    return FindTemplate(temp, doc->root());
+    return !skip_ && type_ != Type::None && type_ != Type::Table && guids_.empty()
+           && template_.empty() && speculative_path_type_ == SpeculativePathType::NONE;
 }
 
-pugi::xpath_node_set XmlOperation::ReadGuidNodes(std::shared_ptr<pugi::xml_document> doc)
+pugi::xpath_node_set XmlOperation::ReadNodes(std::shared_ptr<pugi::xml_document> doc,
+                                             const std::string                  &guid,
+                                             const std::vector<pugi::xml_node>  *targets)
 {
-    pugi::xpath_node_set results;
-    if (!guid_.empty()) {
-        try {
-            auto node = FindAsset(doc, guid_);
-            if (node) {
-                if (speculative_path_ != "*") {
-                    results = node->select_nodes(speculative_path_.c_str());
-                }
-            } else {
-                spdlog::debug("Speculative path failed to find node {}", GetPath());
-            }
-            if (results.empty()) {
-                spdlog::debug("Speculative path failed to find node with path {} {}", GetPath(),
-                              speculative_path_);
-            }
-        } catch (const pugi::xpath_exception &e) {
-            spdlog::warn("Speculative path lookup failed {} (GUID={}) in {}: {}. Please create "
-                         "an issue with the mod op that caused this! Falling back to regular "
-                         "'slow' lookup.",
-                         speculative_path_, guid_, mod_path_.string(), e.what());
-        }
-    } else {
-        spdlog::debug("Not doing speculative path lookup :(");
+    if (auto speculative_results = ReadSpeculativeNodes(doc, guid, targets); speculative_results) {
+        ProfileLookup(SpeculativeLookupName());
+        return std::move(*speculative_results);
+    }
+
+    auto index = XmlIndex::Get(doc);
+    if (index->IsKnownEmpty(GetPath(guid))) {
+        ProfileLookup("known empty");
+        return {};
+    }
+    ProfileLookup("full path");
+    auto results = ReadFullPathNodes(doc, guid);
+    if (results.empty()) {
+        index->SetKnownEmpty(GetPath(guid));
     }
     return results;
 }
 
-pugi::xpath_node_set XmlOperation::ReadTemplateNodes(std::shared_ptr<pugi::xml_document> doc)
+void XmlOperation::Apply(std::shared_ptr<pugi::xml_document> doc, const std::string &guid,
+                         const std::vector<pugi::xml_node> *targets)
 {
-    pugi::xpath_node_set results;
-    if (!template_.empty()) {
-        try {
-            auto node = FindTemplate(doc, template_);
-            if (node) {
-                if (speculative_path_ != "*") {
-                    results = node->select_nodes(speculative_path_.c_str());
+    try {
+        spdlog::debug("Looking up {}", GetPath(guid));
+        pugi::xpath_node_set results;
+        {
+            ProfileTimer timer(&OpProfiler::Sample::lookup_time);
+            results = ReadNodes(doc, guid, targets);
+        }
+        if (staging_) {
+            // A full path lookup can reach into the staged content
+            std::vector<pugi::xpath_node> nodes;
+            for (auto node : results) {
+                auto top = node.node() ? node.node() : node.parent();
+                while (top.parent() && top.parent().type() != pugi::node_document) {
+                    top = top.parent();
+                }
+                if (top != staging_) {
+                    nodes.push_back(node);
                 }
-            } else {
-                spdlog::debug("Speculative path failed to find node {}", GetPath());
-            }
-            if (results.empty()) {
-                spdlog::debug("Speculative path failed to find node with path {} {}", GetPath(),
-                              speculative_path_);
             }
-        } catch (const pugi::xpath_exception &e) {
-            spdlog::warn("Speculative path lookup failed {} (Template={}) in {}: {}. Please create "
-                         "an issue with the mod op that caused this! Falling back to regular "
-                         "'slow' lookup.",
-                         speculative_path_, template_, mod_path_.string(), e.what());
+            results = pugi::xpath_node_set(nodes.data(), nodes.data() + nodes.size(),
+                                           results.type());
         }
-    } else {
-        spdlog::debug("Not doing speculative path lookup :(");
+        Apply(doc, guid, results);
+    } catch (const pugi::xpath_exception &e) {
+        spdlog::error("Failed to parse path {} in {}: {}", GetPath(guid),
+                      context_->patch_path.string(), e.what());
     }
-    return results;
 }
 
-void XmlOperation::Apply(std::shared_ptr<pugi::xml_document> doc)
+void XmlOperation::Apply(std::shared_ptr<pugi::xml_document> doc, const std::string &guid,
+                         const pugi::xpath_node_set &results)
 {
-    if (skip_ || GetType() == XmlOperation::Type::None) {
+    ProfileTimer timer(&OpProfiler::Sample::apply_time);
+    if (profile_sample) {
+        profile_sample->matches += results.size();
+    }
+    if (results.empty()) {
+        Report(Diagnostics::NO_MATCHING_NODE, *context_, offset_, GetPath(guid));
         return;
     }
-    try {
-        spdlog::debug("Looking up {}", path_);
-        pugi::xpath_node_set results = ReadGuidNodes(doc);
 
-        if (results.empty()) {
-            results = ReadTemplateNodes(doc);
-        }
+    spdlog::debug("Lookup finished {}", GetPath(guid));
+    auto index = XmlIndex::Get(doc);
 
-        if (results.empty()) {
-            results = doc->select_nodes(GetPath().c_str());
-        }
-        if (results.empty()) {
-            offset_data_t offset_data;
-            build_offset_data(offset_data, mod_path_.string().c_str());
-            auto [line, column] = get_location(offset_data, node_.offset_debug());
-            spdlog::warn("No matching node for Path {} in {} ({}:{})", GetPath(), mod_name_,
-                         game_path_.string(), line);
-            return;
-        }
+    // With several targets the content is brought into doc once, the targets get copies of that
+    // and the last one gets it moved. Content staged for all GUIDs of the op is only copied.
+    pugi::xml_node staging   = staging_;
+    const bool     own_stage =
+        !staging && results.size() > 1 && type_ != Type::Merge && type_ != Type::Remove;
+    if (own_stage) {
+        staging = ImportContent(*doc);
+    }
+    size_t remaining = results.size();
+    size_t copied    = 0;
+
+    for (pugi::xpath_node xnode : results) {
+        pugi::xml_node game_node = xnode.node();
+        const bool     last      = --remaining == 0;
+        // Calls insert with every content node and whether it can be moved
+        const auto for_each_content = [&](auto insert) {
+            if (!staging) {
+                for (auto node : GetContentNode()) {
+                    insert(node, false);
+                    copied++;
+                }
+                return;
+            }
+            for (auto node = staging.first_child(); node;) {
+                auto next = node.next_sibling();
+                insert(node, last && own_stage);
+                copied++;
+                node = next;
+            }
+        };
 
-        spdlog::debug("Lookup finished {}", path_);
-        for (pugi::xpath_node xnode : results) {
-            pugi::xml_node game_node = xnode.node();
-            if (GetType() == XmlOperation::Type::Merge) {
+        switch (type_) {
+            case Type::Merge: {
+                if (!merge_key_.empty()) {
+                    MergeByKey(*index, game_node);
+                    break;
+                }
                 auto content_node = GetContentNode();
                 if (content_node.begin() == content_node.end()) {
                     //
-                    continue;
-                }
-                pugi::xml_node patching_node = *content_node.begin();
-                RecursiveMerge(game_node, game_node, patching_node);
-            } else if (GetType() == XmlOperation::Type::AddNextSibling) {
-                for (auto &&node : GetContentNode()) {
-                    game_node = game_node.parent().insert_copy_after(node, game_node);
-                }
-            } else if (GetType() == XmlOperation::Type::AddPrevSibling) {
-                for (auto &&node : GetContentNode()) {
-                    game_node.parent().insert_copy_before(node, game_node);
+                    break;
                 }
-            } else if (GetType() == XmlOperation::Type::Add) {
-                for (auto &node : GetContentNode()) {
-                    game_node.append_copy(node);
-                }
-            } else if (GetType() == XmlOperation::Type::Remove) {
+                pugi::xml_node     patching_node = *content_node.begin();
+                XmlIndex::Mutation mutation(*index, game_node);
+                MergeIndex         merge_index;
+                RecursiveMerge(mutation, merge_index, game_node, game_node, patching_node);
+                break;
+            }
+            case Type::AddNextSibling: {
+                XmlIndex::Mutation mutation(*index, game_node.parent());
+                for_each_content([&](pugi::xml_node node, bool move) {
+                    auto parent = game_node.parent();
+                    game_node   = move ? parent.insert_move_after(node, game_node)
+                                       : parent.insert_copy_after(node, game_node);
+                    mutation.Insert(game_node);
+                });
+                break;
+            }
+            case Type::AddPrevSibling: {
+                XmlIndex::Mutation mutation(*index, game_node.parent());
+                for_each_content([&](pugi::xml_node node, bool move) {
+                    auto parent = game_node.parent();
+                    mutation.Insert(move ? parent.insert_move_before(node, game_node)
+                                         : parent.insert_copy_before(node, game_node));
+                });
+                break;
+            }
+            case Type::Add: {
+                XmlIndex::Mutation mutation(*index, game_node);
+                for_each_content([&](pugi::xml_node node, bool move) {
+                    mutation.Insert(move ? game_node.append_move(node)
+                                         : game_node.append_copy(node));
+                });
+                break;
+            }
+            case Type::Remove: {
+                XmlIndex::Mutation mutation(*index, game_node.parent());
+                mutation.Remove(game_node);
                 game_node.parent().remove_child(game_node);
-            } else if (GetType() == XmlOperation::Type::Replace) {
-                for (auto &node : GetContentNode()) {
-                    game_node.parent().insert_copy_after(node, game_node);
-                }
+                break;
+            }
+            case Type::Replace: {
+                XmlIndex::Mutation mutation(*index, game_node.parent());
+                for_each_content([&](pugi::xml_node node, bool move) {
+                    auto parent = game_node.parent();
+                    mutation.Insert(move ? parent.insert_move_after(node, game_node)
+                                         : parent.insert_copy_after(node, game_node));
+                });
+                mutation.Remove(game_node);
                 game_node.parent().remove_child(game_node);
+                break;
             }
+            case Type::None:
+            case Type::Table:
+                break;
         }
-    } catch (const pugi::xpath_exception &e) {
-        spdlog::error("Failed to parse path {} in {}: {}", GetPath(), mod_path_.string(), e.what());
     }
+
+    if (own_stage) {
+        doc->remove_child(staging);
+    }
+    if (profile_sample) {
+        profile_sample->copied += copied;
+    }
+}
+
+pugi::xml_node XmlOperation::ImportContent(pugi::xml_document &doc)
+{
+    // Copied, not parsed into doc with append_buffer. That marks doc as sharing contents, which
+    // turns off the fast document order of every later xpath_node_set sort on it and keeps the
+    // parsed buffers alive as long as doc.
+    auto staging = doc.append_child(pugi::node_element);
+    for (auto node : GetContentNode()) {
+        staging.append_copy(node);
+    }
+    return staging;
+}
+
+pugi::xpath_node_set XmlOperation::ReadFullPathNodes(std::shared_ptr<pugi::xml_document> doc,
+                                                     const std::string &guid)
+{
+    if (shape_ || guids_.empty()) {
+        return doc->select_nodes(*XPathCache::instance().Get(GetPath()));
+    }
+
+    // Compiled once for all GUIDs of this op. Only kept once it compiled, a malformed path
+    // throws again for the next GUID.
+    if (!guid_query_) {
+        auto guid_query = std::make_shared<GuidQuery>();
+        guid_query->variables.add("guid", pugi::xpath_type_string);
+        guid_query->query = std::make_unique<pugi::xpath_query>(
+            ("//Asset[Values/Standard/GUID=$guid]" + path_suffix_).c_str(),
+            &guid_query->variables);
+        guid_query_ = std::move(guid_query);
+    }
+    guid_query_->variables.set("guid", guid.c_str());
+    return doc->select_nodes(*guid_query_->query);
 }
 
 std::vector<XmlOperation> XmlOperation::GetXmlOperations(std::shared_ptr<pugi::xml_document> doc,
                                                          std::string mod_name, fs::path game_path,
-                                                         fs::path mod_path)
+                                                         fs::path               mod_path,
+                                                         std::vector<fs::path>* includes)
+{
+    return GetXmlOperations(std::make_shared<const Context>(Context{doc, std::move(mod_name),
+                                                                    std::move(game_path),
+                                                                    std::move(mod_path), {}}),
+                            includes);
+}
+
+std::vector<XmlOperation> XmlOperation::GetXmlOperations(std::shared_ptr<const Context> context,
+                                                         std::vector<fs::path>*         includes)
 {
 #ifndef _WIN32
     auto stricmp = [](auto a, auto b) { return strcasecmp(a, b); };
 #endif
-    pugi::xml_node root = doc->root();
+    pugi::xml_node root = context->doc->root();
     if (!root) {
         spdlog::error("Failed to get root element");
         return {};
     }
+    const auto      &mod_name = context->mod_name;
+    DiagnosticsScope diagnostics;
+
     std::vector<XmlOperation> mod_operations;
     if (stricmp(root.first_child().name(), "ModOps") == 0) {
         for (pugi::xml_node node : root.first_child().children()) {
@@ -414,22 +1208,49 @@ std::vector<XmlOperation> XmlOperation::GetXmlOperations(std::shared_ptr<pugi::x
                     if (!temp.empty() && !guid.empty()) {
                         spdlog::error("Cannot supply both `Template` and `GUID`");
                     }
+                    if (!GetXmlPropString(node, "BaseGUID").empty()
+                        && !(temp.empty() && guid.empty())) {
+                        spdlog::error(
+                            "Cannot supply `BaseGUID` together with `Template` or `GUID`");
+                    }
                     if (!guid.empty()) {
-                        std::vector<std::string> guids = absl::StrSplit(guid, ',');
-                        for (auto g : guids) {
-                            mod_operations.emplace_back(doc, node, g.data(), "", mod_name, game_path, mod_path);
-                        }   
+                        mod_operations.emplace_back(context, node, guid);
                     } else if (!temp.empty()) {
-                        mod_operations.emplace_back(doc, node, "", temp, mod_name, game_path, mod_path);
+                        mod_operations.emplace_back(context, node, "", temp);
                     } else {
-                        mod_operations.emplace_back(doc, node, "", "", mod_name, game_path, mod_path);
+                        mod_operations.emplace_back(context, node);
+                    }
+                    if (includes && !mod_operations.back().table_file_.empty()) {
+                        includes->push_back(mod_operations.back().TableFilePath());
                     }
                 } else if (stricmp(node.name(), "Include") == 0) {
                     const auto file = GetXmlPropString(node, "File");
-                    auto       include_ops =
-                        GetXmlOperationsFromFile(mod_path / file, mod_name, game_path, mod_path);
-                    mod_operations.insert(std::end(mod_operations), std::begin(include_ops),
-                                          std::end(include_ops));
+                    const auto path = context->mod_path / file;
+                    const auto key  = path.lexically_normal().generic_string();
+                    if (std::find(include_chain.begin(), include_chain.end(), key)
+                        != include_chain.end()) {
+                        spdlog::error("[{}] {} includes itself", mod_name, path.string());
+                        continue;
+                    }
+                    // Also when it can't be loaded, fixing it has to invalidate what was
+                    // read without it
+                    if (includes) {
+                        includes->push_back(path);
+                    }
+                    auto include_doc = IncludeCache::instance().Load(path, mod_name);
+                    if (!include_doc) {
+                        continue;
+                    }
+                    include_chain.push_back(key);
+                    auto include_ops = GetXmlOperations(
+                        std::make_shared<const Context>(Context{include_doc, mod_name,
+                                                                context->game_path,
+                                                                context->mod_path, path}),
+                        includes);
+                    include_chain.pop_back();
+                    mod_operations.insert(std::end(mod_operations),
+                                          std::make_move_iterator(std::begin(include_ops)),
+                                          std::make_move_iterator(std::end(include_ops)));
                 }
             }
         }
@@ -442,30 +1263,65 @@ std::vector<XmlOperation> XmlOperation::GetXmlOperations(std::shared_ptr<pugi::x
 std::vector<XmlOperation> XmlOperation::GetXmlOperationsFromFile(fs::path    path,
                                                                  std::string mod_name,
                                                                  fs::path    game_path,
-                                                                 fs::path    mod_path)
+                                                                 fs::path    mod_path,
+                                                                 std::vector<fs::path>* includes)
 {
-    std::shared_ptr<pugi::xml_document> doc          = std::make_shared<pugi::xml_document>();
-    auto                                parse_result = doc->load_file(path.string().c_str());
-    if (!parse_result) {
-        offset_data_t offset_data;
-        build_offset_data(offset_data, path.string().c_str());
-        auto location = get_location(offset_data, parse_result.offset);
-        spdlog::error("[{}] Failed to parse {}({}, {}): {}", mod_name, path.string(),
-                      location.first, location.second, parse_result.description());
+    auto doc = LoadPatchDocument(path, mod_name);
+    if (!doc) {
         return {};
     }
-    return GetXmlOperations(doc, mod_name, game_path, mod_path);
+    // An <Include> of the file itself is caught before it is expanded a second time
+    include_chain.push_back(path.lexically_normal().generic_string());
+    auto operations = GetXmlOperations(
+        std::make_shared<const Context>(Context{doc, std::move(mod_name), std::move(game_path),
+                                                std::move(mod_path), path}),
+        includes);
+    include_chain.pop_back();
+    return operations;
+}
+
+void XmlOperation::ClearIncludeCache()
+{
+    IncludeCache::instance().Clear();
 }
 
+// Existing attributes are changed where they are, new ones are appended
 void MergeProperties(pugi::xml_node game_node, pugi::xml_node patching_node)
 {
-    for (pugi::xml_attribute &attr : patching_node.attributes()) {
-        if (auto at = game_node.find_attribute(
-                [attr](auto x) { return std::string(x.name()) == attr.name(); });
-            at) {
-            game_node.remove_attribute(at);
+    // Looking up attributes by name only pays off for many of them
+    constexpr size_t HASHED_ATTRIBUTES = 16;
+
+    const auto first = patching_node.first_attribute();
+    if (!game_node || !first) {
+        return;
+    }
+
+    size_t game_attributes = 0;
+    for (auto at = game_node.first_attribute(); at && game_attributes < HASHED_ATTRIBUTES;
+         at = at.next_attribute()) {
+        game_attributes++;
+    }
+    if (!first.next_attribute() || game_attributes < HASHED_ATTRIBUTES) {
+        for (auto attr : patching_node.attributes()) {
+            auto at = game_node.attribute(attr.name());
+            if (!at) {
+                at = game_node.append_attribute(attr.name());
+            }
+            at.set_value(attr.value());
+        }
+        return;
+    }
+
+    std::unordered_map<std::string_view, pugi::xml_attribute> attributes;
+    for (auto at : game_node.attributes()) {
+        attributes.emplace(at.name(), at);
+    }
+    for (auto attr : patching_node.attributes()) {
+        auto [it, added] = attributes.emplace(attr.name(), pugi::xml_attribute{});
+        if (added) {
+            it->second = game_node.append_attribute(attr.name());
         }
-        game_node.append_attribute(attr.name()).set_value(attr.value());
+        it->second.set_value(attr.value());
     }
 }
 
@@ -480,31 +1336,23 @@ static bool HasNonTextNode(pugi::xml_node node)
     return false;
 }
 
-void XmlOperation::RecursiveMerge(pugi::xml_node root_game_node, pugi::xml_node game_node,
+void XmlOperation::RecursiveMerge(XmlIndex::Mutation &mutation, MergeIndex &index,
+                                  pugi::xml_node root_game_node, pugi::xml_node game_node,
                                   pugi::xml_node patching_node)
 {
     if (!patching_node) {
         return;
     }
 
-    const auto find_node_with_name = [](pugi::xml_node game_node, auto name) -> pugi::xml_node {
-        if (game_node.name() == std::string(name)) {
+    const auto find_node_with_name = [&index](pugi::xml_node game_node,
+                                              const char    *name) -> pugi::xml_node {
+        if (std::strcmp(game_node.name(), name) == 0) {
             return game_node;
         }
-        auto children = game_node.children();
-        for (pugi::xml_node cur_node : children) {
-            if (cur_node.name() == std::string(name)) {
-                return cur_node;
-            }
-        }
-        auto cur_node = game_node;
-        while (cur_node) {
-            if (cur_node.name() == std::string(name)) {
-                return cur_node;
-            }
-            cur_node = cur_node.next_sibling();
+        if (auto child = index.FindFrom(game_node.first_child(), name)) {
+            return child;
         }
-        return {};
+        return index.FindFrom(game_node, name);
     };
 
     if (HasNonTextNode(patching_node)) {
@@ -525,19 +1373,25 @@ void XmlOperation::RecursiveMerge(pugi::xml_node root_game_node, pugi::xml_node
             prev_game_node = game_node;
         }
         game_node = find_node_with_name(game_node, cur_node.name());
+        if (cur_node.first_attribute()) {
+            mutation.Change(game_node);
+        }
         MergeProperties(game_node, cur_node);
         if (game_node) {
             if (game_node.type() == pugi::xml_node_type::node_pcdata) {
+                mutation.Change(game_node);
                 game_node.set_value(cur_node.value());
                 return;
             } else {
-                RecursiveMerge(root_game_node, game_node.first_child(), cur_node.first_child());
+                RecursiveMerge(mutation, index, root_game_node, game_node.first_child(),
+                               cur_node.first_child());
             }
             game_node = game_node.next_sibling();
         } else {
             if (cur_node && prev_game_node) {
                 while (prev_game_node) {
-                    RecursiveMerge(root_game_node, prev_game_node.first_child(), cur_node);
+                    RecursiveMerge(mutation, index, root_game_node, prev_game_node.first_child(),
+                                   cur_node);
                     if (prev_game_node == game_node) {
                         break;
                     }
@@ -548,11 +1402,67 @@ void XmlOperation::RecursiveMerge(pugi::xml_node root_game_node, pugi::xml_node
     }
 }
 
+void XmlOperation::MergeByKey(XmlIndex &index, pugi::xml_node game_node)
+{
+    // Name and key text, children without the key can't be matched
+    const auto key_of = [this](pugi::xml_node node) -> std::optional<std::string> {
+        auto key_node = node.first_element_by_path(merge_key_.c_str());
+        if (!key_node) {
+            return {};
+        }
+        return std::string(node.name()) + '\0' + key_node.child_value();
+    };
+
+    XmlIndex::Mutation                              mutation(index, game_node);
+    std::unordered_map<std::string, pugi::xml_node> children;
+    for (auto child : game_node.children()) {
+        if (child.type() == pugi::node_element) {
+            if (auto key = key_of(child)) {
+                // The first one wins, like a search would find it
+                children.emplace(std::move(*key), child);
+            }
+        }
+    }
+
+    for (auto patching_node : GetContentNode()) {
+        if (patching_node.type() != pugi::node_element) {
+            continue;
+        }
+        auto key = key_of(patching_node);
+        if (!key) {
+            spdlog::warn("[{}] {} in merge of {} has no {}, ignoring it", context_->mod_name,
+                         patching_node.name(), GetPath(), merge_key_);
+            continue;
+        }
+        auto [it, added] = children.emplace(std::move(*key), pugi::xml_node{});
+        if (added) {
+            it->second = game_node.append_copy(patching_node);
+            mutation.Insert(it->second);
+        } else {
+            MergeIndex merge_index;
+            if (patching_node.first_attribute()) {
+                mutation.Change(it->second);
+            }
+            MergeProperties(it->second, patching_node);
+            RecursiveMerge(mutation, merge_index, it->second, it->second.first_child(),
+                           patching_node.first_child());
+        }
+    }
+}
+
 std::string XmlOperation::GetPath()
 {
     return path_;
 }
 
+std::string XmlOperation::GetPath(const std::string &guid)
+{
+    if (shape_ || guids_.empty()) {
+        return path_;
+    }
+    return "//Asset[Values/Standard/GUID='" + guid + "']" + path_suffix_;
+}
+
 pugi::xml_object_range<pugi::xml_node_iterator> XmlOperation::GetContentNode()
 {
     return *nodes_;
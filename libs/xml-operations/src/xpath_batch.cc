@@ -0,0 +1,153 @@
+#include "xpath_batch.h"
+
+#include "xpath_cache.h"
+#include "xpath_shape.h"
+
+#include <algorithm>
+#include <set>
+#include <string_view>
+#include <utility>
+
+size_t XPathBatch::Add(const std::string& path)
+{
+    if (auto it = ids_.find(path); it != ids_.end()) {
+        queries_[it->second].pending++;
+        return it->second;
+    }
+
+    auto shape = XPathShape::Parse(path);
+    if (!shape || !Accepts(*shape)) {
+        return npos;
+    }
+    const auto& first = shape->Steps().front();
+
+    Query query;
+    query.name    = first.test;
+    query.pending = 1;
+    try {
+        for (const auto& predicate : first.predicates) {
+            query.local &= XPathShape::IsLocal(predicate);
+            query.predicates.push_back(
+                XPathCache::instance().Get("self::node()[" + predicate + "]"));
+        }
+        if (auto rest = shape->RelativePath(1); !rest.empty()) {
+            query.rest = XPathCache::instance().Get(rest);
+        }
+    } catch (const pugi::xpath_exception&) {
+        return npos;
+    }
+
+    queries_.push_back(std::move(query));
+    ids_.emplace(path, queries_.size() - 1);
+    return queries_.size() - 1;
+}
+
+bool XPathBatch::Accepts(const XPathShape& shape)
+{
+    if (!shape.IsAbsolute() || shape.Steps().empty()) {
+        return false;
+    }
+    const auto& first = shape.Steps().front();
+    if (!first.descendant || first.test == "*" || !first.IsElementTest()) {
+        return false;
+    }
+    // Predicates are checked on each candidate on its own, they must not depend on its position
+    // among its siblings
+    return std::none_of(first.predicates.begin(), first.predicates.end(),
+                        [](const auto& predicate) { return XPathShape::IsPositional(predicate); });
+}
+
+pugi::xpath_node_set XPathBatch::Select(XmlIndex& index, size_t id)
+{
+    if (!queries_[id].valid) {
+        Pass(index, id);
+    }
+
+    const auto& query = queries_[id];
+    if (!query.rest) {
+        std::vector<pugi::xpath_node> nodes(query.matches.begin(), query.matches.end());
+        return pugi::xpath_node_set(nodes.data(), nodes.data() + nodes.size(),
+                                    pugi::xpath_node_set::type_sorted);
+    }
+
+    std::vector<pugi::xpath_node> nodes;
+    for (auto match : query.matches) {
+        auto selected = match.select_nodes(*query.rest);
+        nodes.insert(nodes.end(), selected.begin(), selected.end());
+    }
+    if (query.matches.size() > 1) {
+        // Nested matches can reach the same node twice
+        std::set<std::pair<void*, void*>> seen;
+        nodes.erase(std::remove_if(nodes.begin(), nodes.end(),
+                                   [&seen](const pugi::xpath_node& node) {
+                                       return !seen
+                                                   .emplace(node.node().internal_object(),
+                                                            node.attribute().internal_object())
+                                                   .second;
+                                   }),
+                    nodes.end());
+    }
+    pugi::xpath_node_set results(nodes.data(), nodes.data() + nodes.size());
+    if (query.matches.size() > 1) {
+        results.sort();
+    }
+    return results;
+}
+
+void XPathBatch::Release(size_t id)
+{
+    auto& query = queries_[id];
+    if (query.pending > 0 && --query.pending == 0) {
+        query.valid = false;
+        query.matches.clear();
+        query.matches.shrink_to_fit();
+    }
+}
+
+void XPathBatch::Invalidate(const std::unordered_set<std::string>& names)
+{
+    if (names.empty()) {
+        return;
+    }
+    for (auto& query : queries_) {
+        if (query.valid && names.count(query.name) > 0) {
+            query.valid = false;
+            query.matches.clear();
+        }
+    }
+}
+
+size_t XPathBatch::Passes() const
+{
+    return passes_;
+}
+
+void XPathBatch::Pass(XmlIndex& index, size_t id)
+{
+    std::unordered_map<std::string_view, std::vector<Query*>> by_name;
+    for (size_t i = 0; i < queries_.size(); ++i) {
+        auto& query = queries_[i];
+        // Matches of non-local queries are only good for the op asking right now
+        if (query.pending > 0 && !query.valid && (query.local || i == id)) {
+            query.matches.clear();
+            by_name[query.name].push_back(&query);
+        }
+    }
+
+    for (auto& [name, queries] : by_name) {
+        for (auto node : index.FindByName(std::string(name))) {
+            for (auto query : queries) {
+                if (std::all_of(query->predicates.begin(), query->predicates.end(),
+                                [node](const auto& predicate) {
+                                    return predicate->evaluate_boolean(node);
+                                })) {
+                    query->matches.push_back(node);
+                }
+            }
+        }
+        for (auto query : queries) {
+            query->valid = query->local;
+        }
+    }
+    passes_++;
+}
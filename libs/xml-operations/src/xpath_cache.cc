@@ -0,0 +1,39 @@
+#include "xpath_cache.h"
+
+std::shared_ptr<const pugi::xpath_query> XPathCache::Get(const std::string& expression)
+{
+    {
+        std::scoped_lock lk{mutex_};
+        if (auto it = lookup_.find(expression); it != lookup_.end()) {
+            entries_.splice(entries_.begin(), entries_, it->second);
+            hits_++;
+            return it->second->second;
+        }
+    }
+
+    // Compile outside of the lock, another thread might do the same work but that's fine
+    auto query = std::make_shared<const pugi::xpath_query>(expression.c_str());
+    misses_++;
+
+    std::scoped_lock lk{mutex_};
+    if (auto it = lookup_.find(expression); it != lookup_.end()) {
+        return it->second->second;
+    }
+    entries_.emplace_front(expression, query);
+    lookup_[expression] = entries_.begin();
+    if (entries_.size() > MAX_ENTRIES) {
+        lookup_.erase(entries_.back().first);
+        entries_.pop_back();
+    }
+    return query;
+}
+
+size_t XPathCache::Hits() const
+{
+    return hits_.load();
+}
+
+size_t XPathCache::Misses() const
+{
+    return misses_.load();
+}
@@ -0,0 +1,461 @@
+#include "xpath_shape.h"
+
+#include "xml_index.h"
+#include "xpath_cache.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+namespace
+{
+static std::string_view Trim(std::string_view s)
+{
+    while (!s.empty() && isspace(static_cast<unsigned char>(s.front()))) {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && isspace(static_cast<unsigned char>(s.back()))) {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+static bool IsName(std::string_view s)
+{
+    if (s.empty() || !(isalpha(static_cast<unsigned char>(s[0])) || s[0] == '_')) {
+        return false;
+    }
+    for (char c : s) {
+        if (!(isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '-' || c == '.'
+              || c == ':')) {
+            return false;
+        }
+    }
+    return s.find("::") == std::string_view::npos;
+}
+
+// Calls f(index, c) for every character outside of string literals, brackets and parentheses
+template <typename F> static bool ForEachTopLevel(std::string_view s, F&& f)
+{
+    char quote    = 0;
+    int  brackets = 0;
+    int  parens   = 0;
+    for (size_t i = 0; i < s.size(); ++i) {
+        const char c = s[i];
+        if (quote) {
+            if (c == quote) {
+                quote = 0;
+            }
+            continue;
+        }
+        if (c == '\'' || c == '"') {
+            quote = c;
+            continue;
+        }
+        if (c == '[' || c == '(') {
+            if (brackets == 0 && parens == 0 && !f(i, c)) {
+                return false;
+            }
+            (c == '[' ? brackets : parens)++;
+            continue;
+        }
+        if (c == ']' || c == ')') {
+            auto& depth = c == ']' ? brackets : parens;
+            if (--depth < 0) {
+                return false;
+            }
+            continue;
+        }
+        if (brackets == 0 && parens == 0 && !f(i, c)) {
+            return false;
+        }
+    }
+    return !quote && brackets == 0 && parens == 0;
+}
+
+static std::optional<XPathStep> ParseStep(std::string_view text, bool descendant)
+{
+    text = Trim(text);
+
+    XPathStep step;
+    step.descendant = descendant;
+
+    size_t test_end = text.size();
+    ForEachTopLevel(text, [&test_end](size_t i, char c) {
+        if (c == '[') {
+            test_end = i;
+            return false;
+        }
+        return true;
+    });
+    step.test = std::string(Trim(text.substr(0, test_end)));
+    if (step.test.empty()) {
+        return {};
+    }
+
+    auto rest = text.substr(test_end);
+    while (!(rest = Trim(rest)).empty()) {
+        if (rest.front() != '[') {
+            return {};
+        }
+        int    depth = 0;
+        char   quote = 0;
+        size_t end   = 0;
+        for (size_t i = 0; i < rest.size() && end == 0; ++i) {
+            const char c = rest[i];
+            if (quote) {
+                quote = c == quote ? 0 : quote;
+            } else if (c == '\'' || c == '"') {
+                quote = c;
+            } else if (c == '[') {
+                ++depth;
+            } else if (c == ']' && --depth == 0) {
+                end = i;
+            }
+        }
+        if (end == 0) {
+            return {};
+        }
+        step.predicates.emplace_back(Trim(rest.substr(1, end - 1)));
+        rest = rest.substr(end + 1);
+    }
+    return step;
+}
+} // namespace
+
+bool XPathStep::IsElementTest() const
+{
+    return test == "*" || IsName(test);
+}
+
+bool XPathStep::Matches(pugi::xml_node node) const
+{
+    if (node.type() != pugi::xml_node_type::node_element) {
+        return false;
+    }
+    if (test != "*" && strcmp(node.name(), test.c_str()) != 0) {
+        return false;
+    }
+    for (const auto& predicate : predicates) {
+        auto query = XPathCache::instance().Get("self::node()[" + predicate + "]");
+        if (!query->evaluate_boolean(node)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::optional<XPathEquality> XPathEquality::Parse(std::string_view predicate)
+{
+    size_t equals = std::string_view::npos;
+    size_t count  = 0;
+    if (!ForEachTopLevel(predicate, [&](size_t i, char c) {
+            if (c == '=') {
+                equals = i;
+                ++count;
+            }
+            return true;
+        })
+        || count != 1 || equals == 0) {
+        return {};
+    }
+    if (strchr("!<>", predicate[equals - 1])) {
+        return {};
+    }
+
+    auto lhs = Trim(predicate.substr(0, equals));
+    auto rhs = Trim(predicate.substr(equals + 1));
+    if (!lhs.empty() && (lhs.front() == '\'' || lhs.front() == '"')) {
+        std::swap(lhs, rhs);
+    }
+    if (rhs.size() < 2 || (rhs.front() != '\'' && rhs.front() != '"')
+        || rhs.back() != rhs.front()) {
+        return {};
+    }
+
+    XPathEquality equality;
+    equality.value = std::string(rhs.substr(1, rhs.size() - 2));
+    if (equality.value.find(rhs.front()) != std::string::npos) {
+        return {};
+    }
+
+    if (lhs.substr(0, 2) == "./") {
+        lhs.remove_prefix(2);
+    }
+    while (!lhs.empty()) {
+        auto slash = lhs.find('/');
+        auto name  = Trim(lhs.substr(0, slash));
+        if (!IsName(name)) {
+            return {};
+        }
+        equality.path.emplace_back(name);
+        if (slash == std::string_view::npos) {
+            break;
+        }
+        lhs.remove_prefix(slash + 1);
+        if (lhs.empty()) {
+            return {};
+        }
+    }
+    if (equality.path.empty()) {
+        return {};
+    }
+    return equality;
+}
+
+std::optional<XPathShape> XPathShape::Parse(std::string_view path)
+{
+    path = Trim(path);
+
+    XPathShape shape;
+    shape.absolute_ = !path.empty() && path.front() == '/';
+
+    std::vector<size_t> separators;
+    if (!ForEachTopLevel(path, [&separators](size_t i, char c) {
+            if (c == '|') {
+                return false;
+            }
+            if (c == '/') {
+                separators.push_back(i);
+            }
+            return true;
+        })) {
+        return {};
+    }
+    if (path == "/") {
+        return shape;
+    }
+
+    size_t start      = 0;
+    bool   descendant = false;
+    auto   separator  = separators.begin();
+    while (start <= path.size()) {
+        // Collapse the separator in front of the step
+        size_t slashes = 0;
+        while (separator != separators.end() && *separator == start) {
+            ++slashes;
+            ++start;
+            ++separator;
+        }
+        if (slashes > 2 || (slashes == 0 && start != 0)) {
+            return {};
+        }
+        descendant = slashes == 2;
+
+        const size_t end  = separator == separators.end() ? path.size() : *separator;
+        auto         step = ParseStep(path.substr(start, end - start), descendant);
+        if (!step) {
+            return {};
+        }
+        shape.steps_.push_back(std::move(*step));
+        if (end == path.size()) {
+            break;
+        }
+        start = end;
+    }
+    return shape;
+}
+
+bool XPathShape::IsAbsolute() const
+{
+    return absolute_;
+}
+
+const std::vector<XPathStep>& XPathShape::Steps() const
+{
+    return steps_;
+}
+
+std::string XPathShape::RelativePath(size_t first) const
+{
+    std::string path;
+    for (size_t i = first; i < steps_.size(); ++i) {
+        const auto& step = steps_[i];
+        if (i == first) {
+            path += step.descendant ? ".//" : "";
+        } else {
+            path += step.descendant ? "//" : "/";
+        }
+        path += step.test;
+        for (const auto& predicate : step.predicates) {
+            path += "[" + predicate + "]";
+        }
+    }
+    return path;
+}
+
+std::optional<XPathAnchor> XPathShape::FindAnchor() const
+{
+    if (!absolute_) {
+        return {};
+    }
+
+    struct AnchorType {
+        const char*              element;
+        std::vector<std::string> key_path;
+        XPathAnchor::Kind        kind;
+    };
+    static const std::vector<AnchorType> anchor_types = {
+        {"Asset", {"Values", "Standard", "GUID"}, XPathAnchor::ASSET},
+        {"Assets", {"Asset", "Values", "Standard", "GUID"}, XPathAnchor::ASSET_CONTAINER},
+        {"Template", {"Name"}, XPathAnchor::TEMPLATE},
+        {"Templates", {"Template", "Name"}, XPathAnchor::TEMPLATE_CONTAINER},
+    };
+
+    // Everything up to the anchor has to be verifiable by walking up from the candidate
+    size_t verifiable = 0;
+    while (verifiable < steps_.size() && steps_[verifiable].IsElementTest()) {
+        bool positional = false;
+        for (const auto& predicate : steps_[verifiable].predicates) {
+            positional |= IsPositional(predicate);
+        }
+        if (positional) {
+            break;
+        }
+        ++verifiable;
+    }
+
+    const auto& secondary = XmlIndex::SecondaryIndexes();
+    for (size_t i = verifiable; i-- > 0;) {
+        const auto& step = steps_[i];
+
+        std::vector<XPathEquality> equalities;
+        for (const auto& predicate : step.predicates) {
+            if (auto equality = XPathEquality::Parse(predicate); equality) {
+                equalities.push_back(std::move(*equality));
+            }
+        }
+
+        auto relative_path = RelativePath(i + 1);
+        if (relative_path.empty()) {
+            relative_path = "self::node()";
+        }
+        for (const auto& type : anchor_types) {
+            for (const auto& equality : equalities) {
+                if (step.test == type.element && equality.path == type.key_path) {
+                    return XPathAnchor{type.kind,      type.element, type.key_path,
+                                       equality.value, i,            relative_path};
+                }
+            }
+        }
+        for (const auto& definition : secondary) {
+            for (const auto& equality : equalities) {
+                if (step.test == definition.element && equality.path == definition.key_path) {
+                    return XPathAnchor{XPathAnchor::KEYED, definition.element, definition.key_path,
+                                       equality.value,     i,                  relative_path};
+                }
+            }
+        }
+    }
+    return {};
+}
+
+bool XPathShape::Matches(size_t step, pugi::xml_node node) const
+{
+    const auto& current = steps_[step];
+    if (!current.Matches(node)) {
+        return false;
+    }
+    if (step == 0) {
+        return current.descendant
+               || node.parent().type() == pugi::xml_node_type::node_document;
+    }
+    if (!current.descendant) {
+        return Matches(step - 1, node.parent());
+    }
+    for (auto ancestor = node.parent(); ancestor; ancestor = ancestor.parent()) {
+        if (Matches(step - 1, ancestor)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool XPathShape::IsPositional(std::string_view predicate)
+{
+    predicate = Trim(predicate);
+    if (predicate.empty() || isdigit(static_cast<unsigned char>(predicate.front()))
+        || predicate.front() == '-' || predicate.front() == '(' || predicate.front() == '$') {
+        return true;
+    }
+    if (predicate.find("position()") != std::string_view::npos
+        || predicate.find("last()") != std::string_view::npos) {
+        return true;
+    }
+
+    // Numeric functions only select by position unless they are compared to something
+    bool compared = false;
+    ForEachTopLevel(predicate, [&compared](size_t, char c) {
+        compared |= c == '=' || c == '<' || c == '>';
+        return true;
+    });
+    for (auto function : {"count(", "sum(", "number(", "string-length(", "floor(", "ceiling(",
+                          "round("}) {
+        if (!compared && predicate.substr(0, strlen(function)) == function) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool XPathShape::IsLocal(std::string_view expression)
+{
+    static const std::vector<std::string_view> downward_axes = {
+        "child", "attribute", "self", "descendant", "descendant-or-self"};
+    static const std::vector<std::string_view> operators = {"and", "or", "div", "mod"};
+
+    // Name ending right before end, ignoring whitespace
+    const auto preceding_name = [expression](size_t end) {
+        while (end > 0 && isspace(static_cast<unsigned char>(expression[end - 1]))) {
+            --end;
+        }
+        size_t start = end;
+        while (start > 0
+               && (isalnum(static_cast<unsigned char>(expression[start - 1]))
+                   || expression[start - 1] == '_' || expression[start - 1] == '-')) {
+            --start;
+        }
+        return expression.substr(start, end - start);
+    };
+
+    char quote = 0;
+    char prev  = 0; // Last non whitespace character outside of literals
+    for (size_t i = 0; i < expression.size(); ++i) {
+        const char c = expression[i];
+        if (quote) {
+            if (c == quote) {
+                quote = 0;
+                prev  = c;
+            }
+            continue;
+        }
+        if (isspace(static_cast<unsigned char>(c))) {
+            continue;
+        }
+        if (c == '\'' || c == '"') {
+            quote = c;
+        } else if (c == '$') {
+            return false;
+        } else if (c == '.' && i + 1 < expression.size() && expression[i + 1] == '.') {
+            return false;
+        } else if (c == ':' && i + 1 < expression.size() && expression[i + 1] == ':') {
+            const auto axis = preceding_name(i);
+            if (std::find(downward_axes.begin(), downward_axes.end(), axis)
+                == downward_axes.end()) {
+                return false;
+            }
+            ++i;
+        } else if (c == '/' && prev != '/') {
+            // A path starting at the document root
+            if (prev == 0 || strchr("[(,=<>!|+-", prev)) {
+                return false;
+            }
+            const auto name = preceding_name(i);
+            if (std::find(operators.begin(), operators.end(), name) != operators.end()) {
+                return false;
+            }
+        }
+        prev = c;
+    }
+    return !quote;
+}
@@ -0,0 +1,108 @@
+#include "allocations.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace
+{
+std::atomic<size_t> live_bytes{0};
+std::atomic<size_t> allocations{0};
+std::atomic<size_t> peak_bytes{0};
+
+// Room in front of every block to remember its size, keeps the alignment malloc gives
+constexpr size_t HEADER = alignof(std::max_align_t);
+} // namespace
+
+size_t LiveBytes()
+{
+    return live_bytes;
+}
+
+size_t Allocations()
+{
+    return allocations;
+}
+
+size_t PeakBytes()
+{
+    return peak_bytes;
+}
+
+void ResetPeakBytes()
+{
+    peak_bytes = live_bytes.load();
+}
+
+size_t PeakRss()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters{};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return counters.PeakWorkingSetSize;
+#else
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return static_cast<size_t>(usage.ru_maxrss);
+#else
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+void* operator new(size_t size)
+{
+    auto block = static_cast<char*>(std::malloc(size + HEADER));
+    if (!block) {
+        throw std::bad_alloc();
+    }
+    *reinterpret_cast<size_t*>(block) = size;
+    const auto live = live_bytes += size;
+    auto       peak = peak_bytes.load();
+    while (live > peak && !peak_bytes.compare_exchange_weak(peak, live)) {
+    }
+    allocations++;
+    return block + HEADER;
+}
+
+void operator delete(void* pointer) noexcept
+{
+    if (!pointer) {
+        return;
+    }
+    auto block = static_cast<char*>(pointer) - HEADER;
+    live_bytes -= *reinterpret_cast<size_t*>(block);
+    std::free(block);
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete[](void* pointer) noexcept
+{
+    operator delete(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept
+{
+    operator delete(pointer);
+}
+
+void operator delete[](void* pointer, size_t) noexcept
+{
+    operator delete(pointer);
+}
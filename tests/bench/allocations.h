@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstddef>
+
+// Replaces the global operator new and delete to see what the code under test allocates
+
+// Bytes allocated and not freed yet
+size_t LiveBytes();
+// Number of allocations so far
+size_t Allocations();
+// Most bytes that were alive at once since the last ResetPeakBytes
+size_t PeakBytes();
+void   ResetPeakBytes();
+
+// Peak resident set size of the whole process, 0 where it can't be read
+size_t PeakRss();
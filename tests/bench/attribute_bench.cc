@@ -0,0 +1,68 @@
+#include "xml_operations.h"
+
+#include "benchmark/benchmark.h"
+
+#include <memory>
+#include <string>
+
+static std::shared_ptr<pugi::xml_document> Parse(const std::string& xml)
+{
+    auto doc = std::make_shared<pugi::xml_document>();
+    doc->load_string(xml.c_str());
+    return doc;
+}
+
+// Merges a new zoom level into every preset of a camera.xml with count presets
+static void BM_CameraPresetMerge(benchmark::State& state)
+{
+    const auto count = static_cast<size_t>(state.range(0));
+
+    std::string game = "<Normal><Presets>";
+    for (size_t i = 0; i < count; ++i) {
+        game += "<Preset ID='" + std::to_string(i)
+                + "' Height='40' Pitch='0.875' MinPitch='-0.375' MaxPitch='1.40' Fov='0.56' />";
+    }
+    game += "</Presets><Settings MaxZoomPreset='5' /></Normal>";
+    const auto patch = Parse("<ModOps><ModOp Type='merge' Path='/Normal/Presets/Preset'>"
+                             "<Preset Height='140' MaxPitch='1.5' Fov='0.6' /></ModOp></ModOps>");
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto doc        = Parse(game);
+        auto operations = XmlOperation::GetXmlOperations(patch);
+        state.ResumeTiming();
+
+        XmlOperation::ApplyOperations(operations, doc);
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_CameraPresetMerge)->Arg(16)->Arg(1024);
+
+// Sets half of the attributes of an element with count attributes
+static void BM_WideAttributeMerge(benchmark::State& state)
+{
+    const auto count = static_cast<size_t>(state.range(0));
+
+    std::string game  = "<Test><Node";
+    std::string patch = "<ModOps><ModOp Type='merge' Path='/Test/Node'><Node";
+    for (size_t i = 0; i < count; ++i) {
+        game += " Attribute" + std::to_string(i) + "='0'";
+        if (i % 2 == 0) {
+            patch += " Attribute" + std::to_string(i) + "='1'";
+        }
+    }
+    game += " /></Test>";
+    patch += " /></ModOp></ModOps>";
+    const auto patch_doc = Parse(patch);
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto doc        = Parse(game);
+        auto operations = XmlOperation::GetXmlOperations(patch_doc);
+        state.ResumeTiming();
+
+        XmlOperation::ApplyOperations(operations, doc);
+    }
+    state.SetItemsProcessed(state.iterations() * (count / 2));
+}
+BENCHMARK(BM_WideAttributeMerge)->Arg(8)->Arg(64)->Arg(512);
@@ -0,0 +1,49 @@
+#include "xml_operations.h"
+
+#include "benchmark/benchmark.h"
+#include "spdlog/spdlog.h"
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Patch file with count ops on GUIDs that aren't in the game file, one op per line
+static fs::path WriteFailingPatch(size_t count)
+{
+    const auto    path = fs::temp_directory_path() / "xml-bench-failing.xml";
+    std::ofstream file(path, std::ios::binary);
+    file << "<ModOps>\n";
+    for (size_t i = 0; i < count; ++i) {
+        file << "    <ModOp Type='merge' GUID='" << 900000 + i
+             << "' Path='/Values/Standard'><Standard><Name>Name</Name></Standard></ModOp>\n";
+    }
+    file << "</ModOps>\n";
+    return path;
+}
+
+// A broken mod: every op misses and has its line reported
+static void BM_FailingOps(benchmark::State& state)
+{
+    const auto count = static_cast<size_t>(state.range(0));
+    const auto path  = WriteFailingPatch(count);
+    // Only what happens before formatting counts
+    spdlog::set_level(spdlog::level::off);
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto operations = XmlOperation::GetXmlOperationsFromFile(path, "bench", "assets.xml", path);
+        auto game       = std::make_shared<pugi::xml_document>();
+        game->load_string("<Assets><Asset><Values><Standard><GUID>1</GUID></Standard></Values>"
+                          "</Asset></Assets>");
+        state.ResumeTiming();
+
+        XmlOperation::ApplyOperations(operations, game);
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+
+    spdlog::set_level(spdlog::level::info);
+    std::error_code ec;
+    fs::remove(path, ec);
+}
+BENCHMARK(BM_FailingOps)->Arg(100)->Arg(2000);
@@ -0,0 +1,88 @@
+#include "synthetic_game.h"
+#include "xml_operations.h"
+
+#include "benchmark/benchmark.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// <Asset><Values> with children Item0 to Item{count - 1}, each with a value
+static std::string MakeGame(size_t count)
+{
+    std::string game = "<Assets><Asset><Values>";
+    for (size_t i = 0; i < count; ++i) {
+        const auto name = "Item" + std::to_string(i);
+        game += "<" + name + "><Amount>0</Amount></" + name + ">";
+    }
+    game += "</Values></Asset></Assets>";
+    return game;
+}
+
+// Merges every stride-th item, in document order like mods write them
+static std::shared_ptr<pugi::xml_document> MakePatch(size_t count, size_t stride)
+{
+    std::string patch = "<ModOps><ModOp Type='merge' Path='/Assets/Asset/Values'><Values>";
+    for (size_t i = 0; i < count; i += stride) {
+        const auto name = "Item" + std::to_string(i);
+        patch += "<" + name + " Changed='1'><Amount>1</Amount></" + name + ">";
+    }
+    patch += "</Values></ModOp></ModOps>";
+
+    auto doc = std::make_shared<pugi::xml_document>();
+    doc->load_string(patch.c_str());
+    return doc;
+}
+
+static void BM_WideMerge(benchmark::State& state)
+{
+    const auto count  = static_cast<size_t>(state.range(0));
+    const auto stride = static_cast<size_t>(state.range(1));
+    const auto game   = MakeGame(count);
+    const auto patch  = MakePatch(count, stride);
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto doc = std::make_shared<pugi::xml_document>();
+        doc->load_string(game.c_str());
+        auto operations = XmlOperation::GetXmlOperations(patch);
+        state.ResumeTiming();
+
+        XmlOperation::ApplyOperations(operations, doc);
+    }
+    state.SetItemsProcessed(state.iterations() * (count / stride));
+}
+BENCHMARK(BM_WideMerge)->Args({1000, 1})->Args({1000, 8})->Args({10000, 1})->Args({10000, 8});
+
+// Merges close to the root while the GUID index is built, each changes a single value. What a
+// merge costs must not depend on how much of the document is below the merged node.
+static void BM_MergeNearRoot(benchmark::State& state)
+{
+    constexpr size_t OPS   = 100;
+    const auto       count = static_cast<size_t>(state.range(0));
+    const auto       game  = MakeAssets(count);
+
+    std::string patch = "<ModOps>";
+    for (size_t i = 0; i < OPS; ++i) {
+        const auto guid = AssetGuid(i);
+        patch += "<ModOp Type='merge' GUID='" + guid + "' Path='/Values/Standard'><Standard><Name>"
+                 + "merged_" + guid + "</Name></Standard></ModOp>"
+                 + "<ModOp Type='merge' Path='/AssetList/Groups'><Groups><Group><Name>Merged"
+                 + std::to_string(i) + "</Name></Group></Groups></ModOp>";
+    }
+    patch += "</ModOps>";
+    auto patch_doc = std::make_shared<pugi::xml_document>();
+    patch_doc->load_string(patch.c_str());
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto doc = std::make_shared<pugi::xml_document>();
+        doc->load_string(game.c_str());
+        auto operations = XmlOperation::GetXmlOperations(patch_doc);
+        state.ResumeTiming();
+
+        XmlOperation::ApplyOperations(operations, doc);
+    }
+    state.SetItemsProcessed(state.iterations() * OPS * 2);
+}
+BENCHMARK(BM_MergeNearRoot)->Arg(1000)->Arg(10000);
@@ -0,0 +1,88 @@
+#include "allocations.h"
+#include "xml_operations.h"
+
+#include "benchmark/benchmark.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// Patch with count ops of the kinds mods use most
+static std::shared_ptr<pugi::xml_document> MakePatch(size_t count)
+{
+    std::string patch = "<ModOps>";
+    for (size_t i = 0; i < count; ++i) {
+        const auto guid = std::to_string(100000 + i);
+        switch (i % 4) {
+            case 0:
+                patch += "<ModOp Type='merge' GUID='" + guid
+                         + "' Path='/Values/Standard'><Standard><Name>Name" + guid
+                         + "</Name></Standard></ModOp>";
+                break;
+            case 1:
+                patch += "<ModOp Type='add' GUID='" + guid + "," + std::to_string(200000 + i)
+                         + "' Path='/Values'><Building /></ModOp>";
+                break;
+            case 2:
+                patch += "<ModOp Type='replace' Path=\"//Asset[Values/Standard/GUID='" + guid
+                         + "']/Values/Text\"><Text /></ModOp>";
+                break;
+            case 3:
+                patch += "<ModOp Type='remove' Template='Template" + std::to_string(i)
+                         + "' Path='/Properties/Cost' />";
+                break;
+        }
+    }
+    patch += "</ModOps>";
+
+    auto doc = std::make_shared<pugi::xml_document>();
+    doc->load_string(patch.c_str());
+    return doc;
+}
+
+static void BM_GetXmlOperations(benchmark::State& state)
+{
+    const auto count = static_cast<size_t>(state.range(0));
+    const auto patch = MakePatch(count);
+
+    size_t bytes = 0;
+    for (auto _ : state) {
+        const auto before     = LiveBytes();
+        auto       operations = XmlOperation::GetXmlOperations(
+            patch, "bench", "data/config/export/main/asset/assets.xml", "assets.xml");
+        bytes = LiveBytes() - before;
+        benchmark::DoNotOptimize(operations.data());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+    state.counters["sizeof_op"]    = sizeof(XmlOperation);
+    state.counters["bytes_per_op"] = static_cast<double>(bytes) / count;
+}
+BENCHMARK(BM_GetXmlOperations)->Arg(1000)->Arg(10000);
+
+static void BM_MoveOperations(benchmark::State& state)
+{
+    const auto count = static_cast<size_t>(state.range(0));
+    const auto patch = MakePatch(count);
+
+    size_t allocations = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto                      operations = XmlOperation::GetXmlOperations(patch);
+        std::vector<XmlOperation> moved;
+        moved.reserve(operations.size());
+        const auto before = Allocations();
+        state.ResumeTiming();
+
+        for (auto& operation : operations) {
+            moved.push_back(std::move(operation));
+        }
+
+        state.PauseTiming();
+        allocations = Allocations() - before;
+        benchmark::DoNotOptimize(moved.data());
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+    state.counters["allocations_per_op"] = static_cast<double>(allocations) / count;
+}
+BENCHMARK(BM_MoveOperations)->Arg(1000);
@@ -0,0 +1,95 @@
+#include "synthetic_game.h"
+
+#include <algorithm>
+#include <random>
+
+namespace
+{
+constexpr size_t ASSETS_PER_GROUP = 100;
+
+// The engines of <random> give the same numbers everywhere, its distributions don't
+class Random
+{
+  public:
+    size_t Next(size_t bound)
+    {
+        return static_cast<size_t>(engine_() % bound);
+    }
+
+  private:
+    std::minstd_rand engine_;
+};
+} // namespace
+
+size_t TemplateCount(size_t assets)
+{
+    return std::max<size_t>(assets / 10, 1);
+}
+
+std::string AssetGuid(size_t index)
+{
+    return std::to_string(100000 + index);
+}
+
+std::string TemplateName(size_t index)
+{
+    return "Template" + std::to_string(index);
+}
+
+std::string AssetIcon(size_t index)
+{
+    return "data/ui/icons/icon_" + AssetGuid(index) + ".png";
+}
+
+std::string MakeAssets(size_t count)
+{
+    Random      random;
+    std::string xml = "<AssetList>\n  <Groups>\n";
+    for (size_t i = 0; i < count; ++i) {
+        if (i % ASSETS_PER_GROUP == 0) {
+            xml += "    <Group>\n      <Name>Group" + std::to_string(i / ASSETS_PER_GROUP)
+                   + "</Name>\n      <Assets>\n";
+        }
+        const auto template_name = TemplateName(random.Next(TemplateCount(count)));
+        xml += "        <Asset>\n          <Template>" + template_name + "</Template>\n";
+        if (i > 0 && random.Next(10) == 0) {
+            xml += "          <BaseAssetGUID>" + AssetGuid(random.Next(i)) + "</BaseAssetGUID>\n";
+        }
+        xml += "          <Values>\n            <Standard>\n              <GUID>" + AssetGuid(i)
+               + "</GUID>\n              <Name>asset_" + std::to_string(i)
+               + "</Name>\n              <IconFilename>" + AssetIcon(i)
+               + "</IconFilename>\n            </Standard>\n            <Building>\n"
+                 "              <Cost>"
+               + std::to_string(random.Next(1000))
+               + "</Cost>\n            </Building>\n            <FactoryBase>\n"
+                 "              <FactoryInputs>\n";
+        const auto inputs = 1 + random.Next(3);
+        for (size_t input = 0; input < inputs; ++input) {
+            xml += "                <Item>\n                  <Product>"
+                   + AssetGuid(random.Next(count)) + "</Product>\n                  <Amount>"
+                   + std::to_string(1 + random.Next(5))
+                   + "</Amount>\n                </Item>\n";
+        }
+        xml += "              </FactoryInputs>\n            </FactoryBase>\n          </Values>\n"
+               "        </Asset>\n";
+        if (i % ASSETS_PER_GROUP == ASSETS_PER_GROUP - 1 || i + 1 == count) {
+            xml += "      </Assets>\n    </Group>\n";
+        }
+    }
+    xml += "  </Groups>\n</AssetList>\n";
+    return xml;
+}
+
+std::string MakeTemplates(size_t count)
+{
+    std::string xml = "<Templates>\n  <Group>\n    <Name>Objects</Name>\n";
+    for (size_t i = 0; i < count; ++i) {
+        xml += "    <Template>\n      <Name>" + TemplateName(i)
+               + "</Name>\n      <Properties>\n        <Standard />\n        <Building>\n"
+                 "          <Cost>"
+               + std::to_string(i % 1000)
+               + "</Cost>\n        </Building>\n      </Properties>\n    </Template>\n";
+    }
+    xml += "  </Group>\n</Templates>\n";
+    return xml;
+}
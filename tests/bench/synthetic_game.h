@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Game files shaped like assets.xml and templates.xml. The same count always gives the same
+// document, so numbers from different runs and machines can be compared.
+
+// Assets have the GUIDs AssetGuid(0) to AssetGuid(count - 1), groups of 100 of them
+std::string MakeAssets(size_t count);
+// Templates are called TemplateName(0) to TemplateName(count - 1), all in the Objects group
+std::string MakeTemplates(size_t count);
+
+// Templates MakeAssets refers to
+size_t TemplateCount(size_t assets);
+
+std::string AssetGuid(size_t index);
+std::string TemplateName(size_t index);
+// Unique per asset but not indexed, paths filtering on it have to search the whole file
+std::string AssetIcon(size_t index);
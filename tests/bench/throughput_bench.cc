@@ -0,0 +1,244 @@
+#include "allocations.h"
+#include "synthetic_game.h"
+#include "xml_operations.h"
+
+#include "benchmark/benchmark.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace
+{
+enum class Kind {
+    Add,
+    AddNextSibling,
+    AddPrevSibling,
+    Remove,
+    Replace,
+    Merge,
+    MergeKey,
+    Table,
+    GuidPath,     // GUID taken from a full path
+    FullPath,     // Nothing to look up, searches the whole document
+    MultiGuid,    // Several GUIDs per op
+    Include,      // Merges from included files
+    Template,     // On templates.xml
+    TemplatePath, // Template taken from a full path
+};
+
+// Most assets or templates one run changes, each gets one op
+constexpr size_t MAX_TARGETS         = 1000;
+constexpr size_t FULL_PATH_TARGETS   = 20;
+constexpr size_t GUIDS_PER_OP        = 4;
+constexpr size_t TARGETS_PER_INCLUDE = 100;
+
+const std::string& Assets(size_t count)
+{
+    static std::map<size_t, std::string> documents;
+    auto&                                xml = documents[count];
+    if (xml.empty()) {
+        xml = MakeAssets(count);
+    }
+    return xml;
+}
+
+const std::string& Templates(size_t count)
+{
+    static std::map<size_t, std::string> documents;
+    auto&                                xml = documents[count];
+    if (xml.empty()) {
+        xml = MakeTemplates(count);
+    }
+    return xml;
+}
+
+bool OnTemplates(Kind kind)
+{
+    return kind == Kind::Template || kind == Kind::TemplatePath;
+}
+
+std::string ModOp(Kind kind, size_t index)
+{
+    const auto guid = AssetGuid(index);
+    switch (kind) {
+        case Kind::Add:
+            return "<ModOp Type='add' GUID='" + guid
+                   + "' Path='/Values'><Maintenance><Upkeep>1</Upkeep></Maintenance></ModOp>";
+        case Kind::AddNextSibling:
+            return "<ModOp Type='addNextSibling' GUID='" + guid
+                   + "' Path='/Values/Standard'><Text><LocaText /></Text></ModOp>";
+        case Kind::AddPrevSibling:
+            return "<ModOp Type='addPrevSibling' GUID='" + guid
+                   + "' Path='/Values/Building'><Blocking /></ModOp>";
+        case Kind::Remove:
+            return "<ModOp Type='remove' GUID='" + guid + "' Path='/Values/Building' />";
+        case Kind::Replace:
+            return "<ModOp Type='replace' GUID='" + guid
+                   + "' Path='/Values/Building/Cost'><Cost>5</Cost></ModOp>";
+        case Kind::Merge:
+        case Kind::Include:
+            return "<ModOp Type='merge' GUID='" + guid
+                   + "' Path='/Values/Standard'><Standard><Name>renamed</Name></Standard></ModOp>";
+        case Kind::MergeKey:
+            return "<ModOp Type='merge' GUID='" + guid
+                   + "' Path='/Values/FactoryBase/FactoryInputs' MergeKey='Product'><Item><Product>"
+                   + AssetGuid(0) + "</Product><Amount>9</Amount></Item></ModOp>";
+        case Kind::GuidPath:
+            return "<ModOp Type='merge' Path=\"//Asset[Values/Standard/GUID='" + guid
+                   + "']/Values/Standard\"><Standard><Name>renamed</Name></Standard></ModOp>";
+        case Kind::FullPath:
+            return "<ModOp Type='merge' Path=\"//Asset[Values/Standard/IconFilename='"
+                   + AssetIcon(index)
+                   + "']/Values/Standard\"><Standard><Name>renamed</Name></Standard></ModOp>";
+        case Kind::Template:
+            return "<ModOp Type='add' Template='" + TemplateName(index)
+                   + "' Path='/Properties'><Maintenance /></ModOp>";
+        case Kind::TemplatePath:
+            return "<ModOp Type='add' Path=\"/Templates/Group[Name='Objects']/Template[Name='"
+                   + TemplateName(index) + "']/Properties\"><Maintenance /></ModOp>";
+        case Kind::Table:
+        case Kind::MultiGuid:
+            break;
+    }
+    return "";
+}
+
+struct Patch {
+    std::shared_ptr<pugi::xml_document> doc;
+    size_t                              targets = 0;
+};
+
+// Ops on targets spread evenly over the count assets or templates. Includes are written to
+// directory.
+Patch MakePatch(Kind kind, size_t count, const fs::path& directory)
+{
+    const auto limit   = kind == Kind::FullPath ? FULL_PATH_TARGETS : MAX_TARGETS;
+    const auto targets = std::min(count, limit);
+    const auto target  = [count, targets](size_t i) { return i * count / targets; };
+
+    std::string xml = "<ModOps>";
+    if (kind == Kind::Table) {
+        xml += "<ModOp Type='table'>";
+        for (size_t i = 0; i < targets; ++i) {
+            xml += "<Row GUID='" + AssetGuid(target(i)) + "' Path='Values/Building/Cost'>5</Row>";
+        }
+        xml += "</ModOp>";
+    } else if (kind == Kind::MultiGuid) {
+        for (size_t i = 0; i < targets; i += GUIDS_PER_OP) {
+            std::string guids;
+            for (size_t j = i; j < std::min(i + GUIDS_PER_OP, targets); ++j) {
+                guids += (guids.empty() ? "" : ",") + AssetGuid(target(j));
+            }
+            xml += "<ModOp Type='add' GUID='" + guids + "' Path='/Values'><Maintenance /></ModOp>";
+        }
+    } else if (kind == Kind::Include) {
+        fs::create_directories(directory);
+        for (size_t i = 0; i < targets; i += TARGETS_PER_INCLUDE) {
+            const auto    file = "part" + std::to_string(i / TARGETS_PER_INCLUDE) + ".xml";
+            std::ofstream include(directory / file, std::ios::binary);
+            include << "<ModOps>";
+            for (size_t j = i; j < std::min(i + TARGETS_PER_INCLUDE, targets); ++j) {
+                include << ModOp(kind, target(j));
+            }
+            include << "</ModOps>";
+            xml += "<Include File='" + file + "' />";
+        }
+    } else {
+        for (size_t i = 0; i < targets; ++i) {
+            xml += ModOp(kind, target(i));
+        }
+    }
+    xml += "</ModOps>";
+
+    Patch patch;
+    patch.doc = std::make_shared<pugi::xml_document>();
+    patch.doc->load_string(xml.c_str());
+    patch.targets = targets;
+    return patch;
+}
+
+void AssetCounts(benchmark::internal::Benchmark* benchmark)
+{
+    benchmark->Arg(1000)->Arg(10000)->Arg(100000)->Unit(benchmark::kMillisecond);
+}
+
+void ReportMemory(benchmark::State& state)
+{
+    state.counters["peak_heap"] = benchmark::Counter(static_cast<double>(PeakBytes()),
+                                                     benchmark::Counter::kDefaults,
+                                                     benchmark::Counter::kIs1024);
+    state.counters["peak_rss"]  = benchmark::Counter(static_cast<double>(PeakRss()),
+                                                     benchmark::Counter::kDefaults,
+                                                     benchmark::Counter::kIs1024);
+}
+} // namespace
+
+// Reading the ops of a patch and applying them to a freshly parsed document, like the loader
+// does for every patch file. Items are changed assets or templates, bytes the size of the
+// document.
+static void BM_Apply(benchmark::State& state, Kind kind)
+{
+    const auto  assets    = static_cast<size_t>(state.range(0));
+    const auto  count     = OnTemplates(kind) ? TemplateCount(assets) : assets;
+    const auto& game      = OnTemplates(kind) ? Templates(count) : Assets(count);
+    const auto  game_path = OnTemplates(kind) ? "data/config/game/templates.xml"
+                                              : "data/config/export/main/asset/assets.xml";
+    const auto  directory = fs::temp_directory_path() / ("xml-bench-" + std::to_string(assets));
+    const auto  patch     = MakePatch(kind, count, directory);
+
+    ResetPeakBytes();
+    std::shared_ptr<pugi::xml_document> doc;
+    for (auto _ : state) {
+        state.PauseTiming();
+        doc = std::make_shared<pugi::xml_document>();
+        doc->load_buffer(game.data(), game.size());
+        state.ResumeTiming();
+
+        auto operations = XmlOperation::GetXmlOperations(patch.doc, "bench", game_path, directory);
+        XmlOperation::ApplyOperations(operations, doc);
+    }
+    state.SetItemsProcessed(state.iterations() * patch.targets);
+    state.SetBytesProcessed(state.iterations() * game.size());
+    ReportMemory(state);
+
+    if (kind == Kind::Include) {
+        std::error_code ec;
+        fs::remove_all(directory, ec);
+    }
+}
+BENCHMARK_CAPTURE(BM_Apply, add, Kind::Add)->Apply(AssetCounts);
+BENCHMARK_CAPTURE(BM_Apply, add_next_sibling, Kind::AddNextSibling)->Apply(AssetCounts);
+BENCHMARK_CAPTURE(BM_Apply, add_prev_sibling, Kind::AddPrevSibling)->Apply(AssetCounts);
+BENCHMARK_CAPTURE(BM_Apply, remove, Kind::Remove)->Apply(AssetCounts);
+BENCHMARK_CAPTURE(BM_Apply, replace, Kind::Replace)->Apply(AssetCounts);
+BENCHMARK_CAPTURE(BM_Apply, merge, Kind::Merge)->Apply(AssetCounts);
+BENCHMARK_CAPTURE(BM_Apply, merge_key, Kind::MergeKey)->Apply(AssetCounts);
+BENCHMARK_CAPTURE(BM_Apply, table, Kind::Table)->Apply(AssetCounts);
+BENCHMARK_CAPTURE(BM_Apply, guid_path, Kind::GuidPath)->Apply(AssetCounts);
+BENCHMARK_CAPTURE(BM_Apply, full_path, Kind::FullPath)->Apply(AssetCounts);
+BENCHMARK_CAPTURE(BM_Apply, multi_guid, Kind::MultiGuid)->Apply(AssetCounts);
+BENCHMARK_CAPTURE(BM_Apply, include, Kind::Include)->Apply(AssetCounts);
+BENCHMARK_CAPTURE(BM_Apply, template, Kind::Template)->Apply(AssetCounts);
+BENCHMARK_CAPTURE(BM_Apply, template_path, Kind::TemplatePath)->Apply(AssetCounts);
+
+// What every patch of a file starts with, to compare the ops against
+static void BM_LoadAssets(benchmark::State& state)
+{
+    const auto  count = static_cast<size_t>(state.range(0));
+    const auto& game  = Assets(count);
+
+    ResetPeakBytes();
+    for (auto _ : state) {
+        pugi::xml_document doc;
+        doc.load_buffer(game.data(), game.size());
+        benchmark::DoNotOptimize(doc.first_child());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+    state.SetBytesProcessed(state.iterations() * game.size());
+    ReportMemory(state);
+}
+BENCHMARK(BM_LoadAssets)->Apply(AssetCounts);
@@ -23,11 +23,22 @@ def main():
                                                    base_name + "_input.xml")
                     base_name_patch = os.path.join("tests", "xml", test_type,
                                                    base_name + "_patch.xml")
+                    mod_path = os.path.join("tests", "xml", test_type)
+                    # The loader passes the patch file itself as mod path
+                    if data.get('mod_path') == 'patch':
+                        mod_path = base_name_patch
                     f.write("TestRunner runner(\"%s\", \"%s\", \"%s\");\n" %
-                            (os.path.join("tests", "xml", test_type).replace(
-                                "\\", "/"), base_name_input.replace("\\", "/"),
+                            (mod_path.replace("\\", "/"),
+                             base_name_input.replace("\\", "/"),
                              base_name_patch.replace("\\", "/")))
-                    f.write("runner.ApplyPatches();\n")
+                    # How the advisor says each op finds its targets
+                    if 'lookups' in data:
+                        f.write("CHECK(runner.Lookups() == std::vector<std::string>{%s});\n" %
+                                ", ".join('"%s"' % lookup for lookup in data['lookups']))
+                    if data.get('apply_each', False):
+                        f.write("runner.ApplyEachPatch();\n")
+                    else:
+                        f.write("runner.ApplyPatches();\n")
                     f.write("INFO(runner.DumpXml());")
                     expected_paths = data['expected']
                     for expected_path in expected_paths:
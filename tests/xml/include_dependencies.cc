@@ -0,0 +1,40 @@
+#include "xml_operations.h"
+
+#include "catch2/catch.hpp"
+
+#include <fstream>
+#include <memory>
+#include <vector>
+
+// The loader keys its caches by the includes a patch reports, so one that fails to load has to be
+// reported as well, and reading the patch again once it is fixed has to pick it up
+TEST_CASE("Broken Include Fixed Between Loads") {
+    const auto directory = fs::temp_directory_path() / "xml-tests-broken-include";
+    fs::remove_all(directory);
+    fs::create_directories(directory);
+    const auto patch   = directory / "patch.xml";
+    const auto include = directory / "part.xml";
+    std::ofstream(patch) << "<ModOps><Include File='part.xml' /></ModOps>";
+    std::ofstream(include) << "<ModOps><ModOp Type='add' Path='/A'>";
+
+    std::vector<fs::path> includes;
+    auto operations = XmlOperation::GetXmlOperationsFromFile(patch, "", "", directory, &includes);
+    CHECK(operations.empty());
+    REQUIRE(includes.size() == 1);
+    CHECK(includes.front() == include);
+
+    XmlOperation::ClearIncludeCache();
+    std::ofstream(include) << "<ModOps><ModOp Type='add' Path='/A'><B /></ModOp></ModOps>";
+    includes.clear();
+    operations = XmlOperation::GetXmlOperationsFromFile(patch, "", "", directory, &includes);
+    REQUIRE(operations.size() == 1);
+    CHECK(includes.size() == 1);
+
+    auto doc = std::make_shared<pugi::xml_document>();
+    doc->load_string("<A />");
+    XmlOperation::ApplyOperations(operations, doc);
+    CHECK_FALSE(doc->select_nodes("/A/B").empty());
+
+    XmlOperation::ClearIncludeCache();
+    fs::remove_all(directory);
+}
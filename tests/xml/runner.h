@@ -1,5 +1,6 @@
 #include "pugixml.hpp"
 
+#include "rewrite_advisor.h"
 #include "xml_operations.h"
 
 #include "catch2/catch.hpp"
@@ -24,11 +25,24 @@ public:
     }
 
     void ApplyPatches() {
-        for (auto &&operation : xml_operations_) {
+        XmlOperation::ApplyOperations(xml_operations_, input_doc_);
+    }
+
+    // One op after another, like callers that don't go through ApplyOperations
+    void ApplyEachPatch() {
+        for (auto& operation : xml_operations_) {
             operation.Apply(input_doc_);
         }
     }
 
+    std::vector<std::string> Lookups() {
+        std::vector<std::string> lookups;
+        for (const auto& advice : RewriteAdvisor::Analyse(xml_operations_, input_doc_)) {
+            lookups.push_back(advice.lookup);
+        }
+        return lookups;
+    }
+
     auto GetPatchedDoc() {
         return input_doc_;
     }